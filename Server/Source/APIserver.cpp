@@ -1,17 +1,58 @@
 #include "APIserver.h"
 #include "connection.h"
+#include "connectionPool.h"
 #include <boost/bind.hpp>
 
 APIServer::APIServer(boost::asio::io_service& io_service_, short port_)
 :m_io_service(io_service_),
-    m_acceptor(io_service_, tcp::endpoint(tcp::v4(), port_))
+    m_acceptor(io_service_, tcp::endpoint(tcp::v4(), port_)),
+    m_shards(1, &io_service_),
+    m_firstShard(0),
+    m_nextShard(0)
 {
     Accept();
 }
 
+APIServer::APIServer(std::vector<boost::asio::io_service*>& shards_, uint32 firstShard_, short port_, bool reusePort_)
+:m_io_service(*shards_.front()),
+    m_acceptor(*shards_.front()),
+    m_shards(shards_),
+    m_firstShard(firstShard_),
+    m_nextShard(0)
+{
+    tcp::endpoint endpoint(tcp::v4(), port_);
+    m_acceptor.open(endpoint.protocol());
+    m_acceptor.set_option(tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+    if (reusePort_)
+    {
+        m_acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+    }
+#endif
+    m_acceptor.bind(endpoint);
+    m_acceptor.listen();
+
+    Accept();
+}
+
+bool APIServer::IsReusePortSupported ()
+{
+#ifdef SO_REUSEPORT
+    return true;
+#else
+    return false;
+#endif
+}
+
 void APIServer::Accept ()
 {
-    Connection* connection = new Connection(m_io_service);
+    // The new socket belongs to the io_service of its shard, the acceptor only fills it.
+    uint32 shard = m_nextShard;
+    if (++m_nextShard >= m_shards.size())
+    {
+        m_nextShard = 0;
+    }
+    Connection* connection = ConnectionPool::GetInstance().CreateConnection(*m_shards[shard], m_firstShard+shard);
 
     m_acceptor.async_accept(connection->GetSocket(), boost::bind(&APIServer::Check_Accept, this, connection, boost::asio::placeholders::error));
 }
@@ -24,7 +65,7 @@ void APIServer::Check_Accept (Connection* connection_, const boost::system::erro
     }
     else
     {
-        delete connection_;
+        ConnectionPool::GetInstance().FreeConnection(connection_);
     }
 
     Accept();
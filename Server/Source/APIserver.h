@@ -2,6 +2,8 @@
 #define _SERVER_H_
 
 #include <boost/asio.hpp>
+#include <vector>
+#include "types.h"
 
 using boost::asio::ip::tcp;
 class Connection;
@@ -11,6 +13,13 @@ class APIServer
 public:
     APIServer(boost::asio::io_service& io_service_, short port_);
 
+    // Shard mode, the connections are handed round-robin to the shards_ io_services.
+    // With reusePort_ every shard owns such a listener on the same port and the kernel spreads the
+    // connections between them instead.
+    APIServer(std::vector<boost::asio::io_service*>& shards_, uint32 firstShard_, short port_, bool reusePort_);
+
+    static bool IsReusePortSupported ();
+
 private:
     void Accept ();
 
@@ -18,6 +27,9 @@ private:
 
     boost::asio::io_service& m_io_service;
     boost::asio::ip::tcp::acceptor m_acceptor;
+    std::vector<boost::asio::io_service*> m_shards;
+    uint32 m_firstShard;
+    uint32 m_nextShard;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,213 @@
+#include "config.h"
+#include <luaScript.h>
+#include <boost/thread.hpp>
+#include <algorithm>
+
+#define API_ENDPOINT                    9876
+#define WORKERS_ENDPOINT                1331
+#define RESPONSE_CACHE_ENTRIES          16384
+#define ENTITY_CACHE_ENTRIES            262144
+#define LIST_BATCH_WINDOW               2       // ms
+#define STORE_SEGMENT_SIZE              64      // MB
+#define TASK_TIMEOUT                    1500    // ms
+#define ADAPTIVE_TIMEOUT_FACTOR         4
+#define ADAPTIVE_TIMEOUT_MIN            250     // ms
+#define ADAPTIVE_TIMEOUT_MAX            10000   // ms
+#define HEDGE_BUDGET                    0       // %
+
+Config::Config ()
+    :m_apiPort(API_ENDPOINT),
+    m_workersPort(WORKERS_ENDPOINT),
+    m_ioThreads(1),
+    m_isSharded(false),
+    m_responseCacheEntries(RESPONSE_CACHE_ENTRIES),
+    m_entityCacheEntries(ENTITY_CACHE_ENTRIES),
+    m_listBatchWindow(LIST_BATCH_WINDOW),
+    m_storeSegmentSize(STORE_SEGMENT_SIZE << 20),
+    m_isSpliceRelay(false),
+    m_taskTimeout(TASK_TIMEOUT),
+    m_isAdaptiveTimeout(false),
+    m_adaptiveTimeoutFactor(ADAPTIVE_TIMEOUT_FACTOR),
+    m_adaptiveTimeoutMin(ADAPTIVE_TIMEOUT_MIN),
+    m_adaptiveTimeoutMax(ADAPTIVE_TIMEOUT_MAX),
+    m_hedgeBudget(HEDGE_BUDGET)
+{
+}
+
+bool Config::Load (const char* fileName_)
+{
+    utils::LuaScript script;
+    if (!script.LoadFromFile(fileName_))
+    {
+        return false;
+    }
+
+    lua_Integer value = 0;
+    script.GetGlobalInteger("api_port", &value, API_ENDPOINT);
+    m_apiPort = (uint16)value;
+
+    script.GetGlobalInteger("workers_port", &value, WORKERS_ENDPOINT);
+    m_workersPort = (uint16)value;
+
+    // 0 means one I/O thread per hardware thread.
+    script.GetGlobalInteger("io_threads", &value, 1);
+    m_ioThreads = (value > 0) ? (uint32)value : boost::thread::hardware_concurrency();
+    if (m_ioThreads == 0)
+    {
+        m_ioThreads = 1;
+    }
+
+    std::string mode;
+    script.GetGlobalString("io_mode", &mode, "pool");
+    m_isSharded = (mode == "shards");
+    if (m_isSharded && m_ioThreads > SERVER_MAX_SHARDS)
+    {
+        m_ioThreads = SERVER_MAX_SHARDS;
+    }
+
+    script.GetGlobalInteger("response_cache_entries", &value, RESPONSE_CACHE_ENTRIES);
+    m_responseCacheEntries = (value > 0) ? (uint32)value : 0;
+
+    script.GetGlobalInteger("entity_cache_entries", &value, ENTITY_CACHE_ENTRIES);
+    m_entityCacheEntries = (value > 0) ? (uint32)value : 0;
+
+    script.GetGlobalInteger("list_batch_window", &value, LIST_BATCH_WINDOW);
+    m_listBatchWindow = (value > 0 && value < 1000) ? (uint32)value : 0;
+
+    script.GetGlobalString("store_directory", &m_storeDirectory, "");
+
+    script.GetGlobalInteger("store_segment_size", &value, STORE_SEGMENT_SIZE);
+    m_storeSegmentSize = (value > 0 && value < 4096) ? (uint32)value << 20 : STORE_SEGMENT_SIZE << 20;
+
+    script.GetGlobalString("relay_mode", &mode, "copy");
+    m_isSpliceRelay = (mode == "splice");
+
+    script.GetGlobalInteger("task_timeout", &value, TASK_TIMEOUT);
+    m_taskTimeout = (value > 0) ? (uint32)value : TASK_TIMEOUT;
+
+    // route_timeouts = { ["/route/{pattern}"] = ms, ... }
+    lua_State* state = script.GetState();
+    lua_getglobal(state, "route_timeouts");
+    if (lua_istable(state, -1))
+    {
+        lua_pushnil(state);
+        while (lua_next(state, -2) != 0)
+        {
+            if (lua_type(state, -2) == LUA_TSTRING && lua_isnumber(state, -1) && lua_tointeger(state, -1) > 0)
+            {
+                m_routeTimeouts[lua_tostring(state, -2)] = (uint32)lua_tointeger(state, -1);
+            }
+            lua_pop(state, 1);
+        }
+    }
+    lua_pop(state, 1);
+
+    script.GetGlobalString("timeout_mode", &mode, "fixed");
+    m_isAdaptiveTimeout = (mode == "adaptive");
+
+    lua_Number factor = 0;
+    script.GetGlobalNumber("adaptive_timeout_factor", &factor, ADAPTIVE_TIMEOUT_FACTOR);
+    m_adaptiveTimeoutFactor = (factor >= 1) ? factor : ADAPTIVE_TIMEOUT_FACTOR;
+
+    script.GetGlobalInteger("adaptive_timeout_min", &value, ADAPTIVE_TIMEOUT_MIN);
+    m_adaptiveTimeoutMin = (value > 0) ? (uint32)value : ADAPTIVE_TIMEOUT_MIN;
+
+    script.GetGlobalInteger("adaptive_timeout_max", &value, ADAPTIVE_TIMEOUT_MAX);
+    m_adaptiveTimeoutMax = std::max<uint32>((value > 0) ? (uint32)value : ADAPTIVE_TIMEOUT_MAX, m_adaptiveTimeoutMin);
+
+    script.GetGlobalInteger("hedge_budget", &value, HEDGE_BUDGET);
+    m_hedgeBudget = (value > 0 && value <= 100) ? (uint32)value : 0;
+    return true;
+}
+
+uint16 Config::GetAPIPort () const
+{
+    return m_apiPort;
+}
+
+uint16 Config::GetWorkersPort () const
+{
+    return m_workersPort;
+}
+
+uint32 Config::GetIOThreads () const
+{
+    return m_ioThreads;
+}
+
+bool Config::IsSharded () const
+{
+    return m_isSharded;
+}
+
+uint32 Config::GetResponseCacheEntries () const
+{
+    return m_responseCacheEntries;
+}
+
+uint32 Config::GetEntityCacheEntries () const
+{
+    return m_entityCacheEntries;
+}
+
+uint32 Config::GetListBatchWindow () const
+{
+    return m_listBatchWindow;
+}
+
+const std::string& Config::GetStoreDirectory () const
+{
+    return m_storeDirectory;
+}
+
+uint32 Config::GetStoreSegmentSize () const
+{
+    return m_storeSegmentSize;
+}
+
+bool Config::IsSpliceRelay () const
+{
+    return m_isSpliceRelay;
+}
+
+uint32 Config::GetTaskTimeout () const
+{
+    return m_taskTimeout;
+}
+
+uint32 Config::GetRouteTimeout (const std::string& pattern_) const
+{
+    std::map<std::string, uint32>::const_iterator it = m_routeTimeouts.find(pattern_);
+    return (it != m_routeTimeouts.end()) ? (*it).second : m_taskTimeout;
+}
+
+bool Config::IsAdaptiveTimeout () const
+{
+    return m_isAdaptiveTimeout;
+}
+
+double Config::GetAdaptiveTimeoutFactor () const
+{
+    return m_adaptiveTimeoutFactor;
+}
+
+uint32 Config::GetAdaptiveTimeoutMin () const
+{
+    return m_adaptiveTimeoutMin;
+}
+
+uint32 Config::GetAdaptiveTimeoutMax () const
+{
+    return m_adaptiveTimeoutMax;
+}
+
+uint32 Config::GetHedgeBudget () const
+{
+    return m_hedgeBudget;
+}
+
+Config& Config::GetInstance ()
+{
+    static Config instance;
+    return instance;
+}
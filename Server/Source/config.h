@@ -0,0 +1,73 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include "types.h"
+#include <string>
+#include <map>
+
+#define CONFIG_FILE                     "config.lua"
+// Task ids keep the shard in their low bits, see TaskHolder.
+#define SERVER_SHARD_BITS               4
+#define SERVER_MAX_SHARDS               (1 << SERVER_SHARD_BITS)
+
+///
+/// Server settings, read once from config.lua at startup. Every setting has a default, so a
+/// missing file or entry leaves the server with its previous hard-coded behaviour.
+///
+class Config
+{
+public:
+    bool Load (const char* fileName_);
+
+    uint16 GetAPIPort () const;
+    uint16 GetWorkersPort () const;
+    uint32 GetIOThreads () const;
+    // In shard mode every I/O thread runs its own io_service and API listener.
+    bool IsSharded () const;
+    uint32 GetResponseCacheEntries () const;
+    uint32 GetEntityCacheEntries () const;
+    // Milliseconds the short list requests of a route wait to be sent together, 0 to disable.
+    uint32 GetListBatchWindow () const;
+    // Directory of the ResponseStore segments, empty to keep the cache in memory only.
+    const std::string& GetStoreDirectory () const;
+    // Size in bytes of a ResponseStore segment file.
+    uint32 GetStoreSegmentSize () const;
+    // Large worker responses go from the worker socket to the client socket with splice(2), Linux only.
+    bool IsSpliceRelay () const;
+    // Milliseconds a task waits for a worker, for the routes without a timeout of their own.
+    uint32 GetTaskTimeout () const;
+    // Timeout of the route with this pattern, see routes.h.
+    uint32 GetRouteTimeout (const std::string& pattern_) const;
+    // The route timeouts follow the latency of their tasks, see TaskTimeouts.
+    bool IsAdaptiveTimeout () const;
+    double GetAdaptiveTimeoutFactor () const;
+    uint32 GetAdaptiveTimeoutMin () const;
+    uint32 GetAdaptiveTimeoutMax () const;
+    // Percent of extra worker tasks the hedged requests may add, 0 to disable them, see Hedger.
+    uint32 GetHedgeBudget () const;
+
+    static Config& GetInstance ();
+
+private:
+    Config ();
+
+    uint16 m_apiPort;
+    uint16 m_workersPort;
+    uint32 m_ioThreads;
+    bool m_isSharded;
+    uint32 m_responseCacheEntries;
+    uint32 m_entityCacheEntries;
+    uint32 m_listBatchWindow;
+    std::string m_storeDirectory;
+    uint32 m_storeSegmentSize;
+    bool m_isSpliceRelay;
+    uint32 m_taskTimeout;
+    std::map<std::string, uint32> m_routeTimeouts;
+    bool m_isAdaptiveTimeout;
+    double m_adaptiveTimeoutFactor;
+    uint32 m_adaptiveTimeoutMin;
+    uint32 m_adaptiveTimeoutMax;
+    uint32 m_hedgeBudget;
+};
+
+#endif
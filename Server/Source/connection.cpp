@@ -7,27 +7,94 @@
 #include "workers.h"
 #include "request.h"
 #include "task.h"
+#include "connectionPool.h"
+#include "worker.h"
+#include "contentEncoding.h"
+#include "metrics.h"
+#include <rapidjson/document.h>
 
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
 #include <boost/date_time/posix_time/posix_time.hpp>
-uint id = 0;
+#ifdef SPLICE_F_MOVE
+#include <errno.h>
+#endif
 
-Connection::Connection (boost::asio::io_service& io_service_)
-: m_socket(io_service_),
-  m_id(id++),
-  m_relatedTask(nullptr),
+#define CONNECTION_IDLE_TIMEOUT         15000
+#define CONNECTION_MAX_PIPELINED        16
+#define CONNECTION_MAX_BODY             16384
+#define CONNECTION_MAX_BATCH            50
+
+namespace
+{
+    // Appends data_ to out_ as one chunk of a chunked transfer coding.
+    void AppendChunk (std::string& out_, const std::string& data_)
+    {
+        char size[16];
+        sprintf(size, "%x\r\n", (uint32)data_.size());
+        out_.append(size);
+        out_.append(data_);
+        out_.append("\r\n");
+    }
+
+    void AppendJsonString (std::string& out_, const std::string& string_)
+    {
+        out_.push_back('"');
+        for (size_t i = 0; i < string_.size(); i++)
+        {
+            unsigned char c = string_[i];
+            if (c == '"' || c == '\\')
+            {
+                out_.push_back('\\');
+                out_.push_back(c);
+            }
+            else if (c < 0x20)
+            {
+                char escaped[8];
+                sprintf(escaped, "\\u%04x", c);
+                out_.append(escaped);
+            }
+            else
+            {
+                out_.push_back(c);
+            }
+        }
+        out_.push_back('"');
+    }
+}
+
+boost::atomic<uint> id(0);
+
+Connection::Connection (boost::asio::io_service& io_service_, uint32 shard_)
+: m_isReading(false),
   m_isSending(false),
-  m_sendDataLength(0)
+  m_sendingCount(0),
+  m_sendingLength(0),
+  m_isClosing(false),
+  m_isRelaying(false),
+  m_relayPiped(0),
+  m_relayableTask(0),
+  m_acceptRequests(true),
+  m_pendingTimers(0),
+  m_pendingPosts(0),
+  m_id(id++),
+  m_shard(shard_),
+  m_subRequests(0),
+  m_splitParent(0),
+  m_socket(io_service_),
+  m_strand(io_service_),
+  m_bufferData(nullptr),
+  m_bufferLength(0)
 {
+    m_idleTimer.SetHandler(boost::bind(&Connection::_IdleTimerExpired, this, boost::asio::placeholders::error));
+    m_relayTimer.SetHandler(boost::bind(&Connection::_RelayTimerExpired, this, boost::asio::placeholders::error));
 }
 
 Connection::~Connection ()
 {
     CloseConnection();
-    if (m_relatedTask)
-    {
-        m_relatedTask->CancelTask();
-    }
+    _ReleaseBuffer();
 }
 
 boost::asio::ip::tcp::socket& Connection::GetSocket ()
@@ -44,118 +111,893 @@ void Connection::CloseConnection ()
 
 void Connection::MainLoop ()
 {
-    m_socket.async_read_some(boost::asio::buffer(m_bufferData, max_length), 
-        boost::bind(&Connection::_ReceiveData, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+    // _ReadReady() only reads what is already there.
+    boost::system::error_code error;
+    m_socket.non_blocking(true, error);
+    m_strand.post(boost::bind(&Connection::_Read, this));
+}
+
+void Connection::SendAndRelease (const char* data_, size_t dataLength_)
+{
+    if (m_responses.empty() || m_responses.back().m_isReady || m_responses.back().m_hasTask)
+    {
+        return;
+    }
+
+    Response& response = m_responses.back();
+    response.m_data.assign(data_, dataLength_);
+    response.m_isReady = true;
+    _SendResponses();
+}
+
+void Connection::SetRelatedTask (Task* task_)
+{
+    if (!m_responses.empty())
+    {
+        m_responses.back().m_taskID = task_->GetTaskID();
+        m_responses.back().m_hasTask = true;
+    }
+}
+
+void Connection::CompleteTask (uint32 taskID_, std::string& response_)
+{
+    // The task is locked and still attached, so _Close() cannot have detached it yet and will see this post.
+    std::string* response = new std::string();
+    response->swap(response_);
+    m_pendingPosts++;
+    m_strand.post(boost::bind(&Connection::_CompleteTask, this, taskID_, response));
+}
+
+void Connection::StreamTask (uint32 taskID_, const boost::shared_ptr<const std::string>& part_, bool isLast_)
+{
+    m_pendingPosts++;
+    m_strand.post(boost::bind(&Connection::_StreamTask, this, taskID_, part_, isLast_));
+}
+
+void Connection::AbortTask (uint32 taskID_)
+{
+    m_pendingPosts++;
+    m_strand.post(boost::bind(&Connection::_AbortTask, this, taskID_));
+}
+
+void Connection::RelayTask (uint32 taskID_, Worker* worker_, const std::string& headers_, uint32 remaining_)
+{
+    m_pendingPosts++;
+    m_strand.post(boost::bind(&Connection::_RelayTask, this, taskID_, worker_, new std::string(headers_), remaining_));
+}
+
+bool Connection::CanRelay (uint32 taskID_) const
+{
+    return m_relayableTask.load(boost::memory_order_acquire) == ((uint64)1 << 32 | taskID_);
+}
+
+void Connection::RelayReadable (const boost::system::error_code& error_)
+{
+    m_pendingPosts++;
+    m_strand.post(boost::bind(&Connection::_RelayReadable, this, error_));
+}
+
+bool Connection::IsSpliceSupported ()
+{
+#ifdef SPLICE_F_MOVE
+    return true;
+#else
+    return false;
+#endif
+}
+
+boost::asio::io_service& Connection::GetIOService ()
+{
+    return m_socket.get_io_service();
+}
+
+uint32 Connection::GetShard () const
+{
+    return m_shard;
+}
+
+bool Connection::AcceptsGzip () const
+{
+    return m_responses.empty() || m_responses.back().m_acceptsGzip;
+}
+
+void Connection::SetRequestRoute (const Route* route_)
+{
+    m_responses.back().m_route = route_;
+}
+
+void Connection::SplitList (const boost::shared_ptr<ListRequest>& list_)
+{
+    m_splitParent = m_responses.size()-1;
+    Response& list = m_responses.back();
+    list.m_subPending = list_->m_parts.size();
+    list.m_list = list_;
+}
+
+void Connection::AddListPart (uint32 index_)
+{
+    _PushSubRequest(m_splitParent);
+    m_responses.back().m_subIndexes.push_back(index_);
+}
+
+void Connection::_Read ()
+{
+    if (!m_isReading && m_bufferLength == 0)
+    {
+        _ReleaseBuffer();
+    }
+
+    if (m_isReading || m_isClosing || !m_acceptRequests || m_responses.size() >= CONNECTION_MAX_PIPELINED)
+    {
+        return;
+    }
+
+    m_isReading = true;
+    if (m_bufferData)
+    {
+        // Part of a request is waiting for the rest, keeps reading into the same buffer.
+        m_socket.async_read_some(boost::asio::buffer(m_bufferData+m_bufferLength, CONNECTION_BUFFER_SIZE-m_bufferLength),
+            m_strand.wrap(boost::bind(&Connection::_ReceiveData, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+    }
+    else
+    {
+        // Waits for the socket to be readable without holding a buffer.
+        m_socket.async_read_some(boost::asio::null_buffers(),
+            m_strand.wrap(boost::bind(&Connection::_ReadReady, this, boost::asio::placeholders::error)));
+    }
+
+    if (m_responses.empty())
+    {
+        _ArmIdleTimer();
+    }
+}
+
+void Connection::_ReadReady (const boost::system::error_code& error_)
+{
+    m_isReading = false;
+    if (error_ || m_isClosing)
+    {
+        _Close();
+        return;
+    }
+
+    m_bufferData = ConnectionPool::GetInstance().AcquireBuffer(m_shard);
+    if (!m_bufferData)
+    {
+        _Close();
+        return;
+    }
+
+    boost::system::error_code error;
+    size_t dataLength = m_socket.read_some(boost::asio::buffer(m_bufferData, CONNECTION_BUFFER_SIZE), error);
+    if (error == boost::asio::error::would_block)
+    {
+        _Read();
+        return;
+    }
+    _ReceiveData(error, dataLength);
+}
+
+void Connection::_ReceiveData (const boost::system::error_code& error_, size_t dataLength_)
+{
+    m_isReading = false;
+    if (error_ || m_isClosing)
+    {
+        _Close();
+        return;
+    }
+
+    m_idleTimer.Cancel();
+
+    m_bufferLength += dataLength_;
+    _ProcessBuffer();
+
+    if (m_acceptRequests && m_bufferLength == CONNECTION_BUFFER_SIZE && m_responses.size() < CONNECTION_MAX_PIPELINED)
+    {
+        // The buffer is full and yet there is no complete request in it.
+        m_responses.push_back(Response(false, true));
+        m_acceptRequests = false;
+        SendAndRelease(Request::s_badRequest, strlen(Request::s_badRequest));
+    }
+
+    // Also lets the worker of a task just dispatched relay its response.
+    _SendResponses();
+    _Read();
 }
 
-void Connection::SendData (const char* data_, size_t dataLength_)
+void Connection::_ProcessBuffer ()
 {
-    // Sadly, it must be this way since Microsoft Windows limit on 65536 data.
-    size_t left = dataLength_;
-    while (left > 0)
+    char* begin = m_bufferData;
+    char* end = m_bufferData+m_bufferLength;
+
+    // Handles every complete request in the buffer, pipelined ones included. A request split
+    // across reads stays in the buffer and the parser resumes on it once more data arrives.
+    while (!m_isClosing && m_acceptRequests && m_responses.size() < CONNECTION_MAX_PIPELINED && begin != end)
     {
-        if (left > 1408)
+        HttpParser::Result result = m_parser.Parse(begin, end-begin);
+        if (result == HttpParser::Incomplete)
+        {
+            break;
+        }
+
+        uint32 bodyLength = 0;
+        if (result == HttpParser::Failed || !m_parser.GetBodyLength(bodyLength) || bodyLength > CONNECTION_MAX_BODY)
         {
-            boost::asio::async_write(m_socket, boost::asio::buffer(data_, 1408), 
-                boost::bind(&Connection::_HandleErrors, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
-            data_ += 1408;
-            left -= 1408;
+            m_responses.push_back(Response(false, true));
+            m_acceptRequests = false;
+            SendAndRelease(Request::s_badRequest, strlen(Request::s_badRequest));
+            begin = end;
+            break;
         }
-        else
+
+        // The body follows the headers, the request waits for it in the buffer.
+        size_t requestLength = m_parser.GetRequestLength()+bodyLength;
+        if ((size_t)(end-begin) < requestLength)
         {
-            boost::asio::async_write(m_socket, boost::asio::buffer(data_, left), 
-                boost::bind(&Connection::_HandleErrors, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
             break;
         }
+
+        _HandleRequest(begin+m_parser.GetRequestLength(), bodyLength);
+        begin += requestLength;
+        m_parser.Reset();
+    }
+
+    m_bufferLength = end-begin;
+    if (begin != m_bufferData)
+    {
+        memmove(m_bufferData, begin, m_bufferLength);
     }
 }
 
-void Connection::SendAndRelease (const char* data_, size_t dataLength_)
+void Connection::_HandleRequest (const char* body_, uint32 bodyLength_)
 {
-    m_isSending = true;
-    m_sendDataLength = dataLength_;
-    SendData(data_, dataLength_);
+    bool keepAlive = m_parser.IsKeepAlive();
+    if (!keepAlive)
+    {
+        m_acceptRequests = false;
+    }
+    m_responses.push_back(Response(keepAlive, ContentEncoding::AcceptsGzip(m_parser)));
+    Metrics::GetInstance().Increment(Metrics::Counter_Requests);
+
+    if (m_parser.GetMethod() == "GET")
+    {
+        if (!Workers::GetInstance().HasAvailableWorker(m_shard))
+        {
+            Metrics::GetInstance().Increment(Metrics::Counter_Unavailable);
+            SendAndRelease(Request::s_serviceUnavailable, strlen(Request::s_serviceUnavailable));
+        }
+        else if (!Request::ParseRequest(m_parser, this))
+        {
+            SendAndRelease(Request::s_badRequest, strlen(Request::s_badRequest));
+        }
+    }
+    else if (m_parser.GetMethod() == "POST" && m_parser.GetPath() == "/batch")
+    {
+        _HandleBatch(body_, bodyLength_);
+    }
+    else
+    {
+        Metrics::GetInstance().Increment(Metrics::Counter_Unavailable);
+        SendAndRelease(Request::s_serviceUnavailable, strlen(Request::s_serviceUnavailable));
+    }
 }
 
-void Connection::SetRelatedTask (Task* task_)
+void Connection::_HandleBatch (const char* body_, uint32 bodyLength_)
+{
+    // The combined document has no known length, it needs the chunked transfer coding.
+    if (m_parser.GetMinorVersion() == 0)
+    {
+        SendAndRelease(Request::s_versionNotSupported, strlen(Request::s_versionNotSupported));
+        return;
+    }
+
+    std::string body(body_, bodyLength_);
+    rapidjson::Document paths;
+    paths.Parse<0>(body.c_str());
+    bool isValid = !paths.HasParseError() && paths.IsArray() && paths.Size() <= CONNECTION_MAX_BATCH;
+    for (rapidjson::SizeType i = 0; isValid && i < paths.Size(); i++)
+    {
+        isValid = paths[i].IsString() && paths[i].GetStringLength() > 0 && paths[i].GetString()[0] == '/';
+    }
+    if (!isValid)
+    {
+        SendAndRelease(Request::s_badRequest, strlen(Request::s_badRequest));
+        return;
+    }
+
+    // A path listed twice is requested once, a connection waits for a task only once.
+    std::vector<std::string> itemPaths;
+    std::vector<std::vector<uint32>> itemIndexes;
+    for (rapidjson::SizeType i = 0; i < paths.Size(); i++)
+    {
+        std::string path(paths[i].GetString(), paths[i].GetStringLength());
+        size_t item = std::find(itemPaths.begin(), itemPaths.end(), path)-itemPaths.begin();
+        if (item == itemPaths.size())
+        {
+            itemPaths.push_back(path);
+            itemIndexes.push_back(std::vector<uint32>());
+        }
+        itemIndexes[item].push_back(i);
+    }
+
+    // The items are answered in the order they complete, each one tells its index in the request.
+    size_t parent = m_responses.size()-1;
+    Response& batch = m_responses.back();
+    boost::shared_ptr<std::string> headers(new std::string("HTTP/1.1 200 OK\r\n"));
+    if (!batch.m_keepAlive)
+    {
+        headers->append("Connection: close\r\n");
+    }
+    headers->append("Content-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n");
+    AppendChunk(*headers, "{\"success\":true, \"code\":200, \"data\":[");
+    if (itemPaths.empty())
+    {
+        AppendChunk(*headers, "]}");
+        headers->append("0\r\n\r\n");
+        batch.m_isReady = true;
+    }
+    batch.m_isBatch = true;
+    batch.m_isStreaming = true;
+    batch.m_parts.push_back(headers);
+    batch.m_subPending = itemPaths.size();
+
+    for (size_t i = 0; i < itemPaths.size(); i++)
+    {
+        _PushSubRequest(parent);
+        Response& item = m_responses.back();
+        item.m_subPath = itemPaths[i];
+        item.m_subIndexes.swap(itemIndexes[i]);
+
+        if (!Workers::GetInstance().HasAvailableWorker(m_shard))
+        {
+            Metrics::GetInstance().Increment(Metrics::Counter_Unavailable);
+            SendAndRelease(Request::s_serviceUnavailable, strlen(Request::s_serviceUnavailable));
+        }
+        else if (!Request::ParsePath(itemPaths[i], this))
+        {
+            SendAndRelease(Request::s_badRequest, strlen(Request::s_badRequest));
+        }
+    }
+    _SendResponses();
+}
+
+void Connection::_PushSubRequest (size_t parent_)
 {
-    m_relatedTask = task_;
+    // Sub-requests take the identity encoding, their responses are parsed before being sent.
+    m_responses.push_back(Response(true, false));
+    m_responses.back().m_parentOffset = m_responses.size()-1-parent_;
+    m_subRequests++;
 }
 
-boost::asio::io_service& Connection::GetIOService ()
+void Connection::_RecordLatency (Response& response_)
 {
-    return m_socket.get_io_service();
+    // Only once, folded sub-requests stay in the queue until their parent is written.
+    if (response_.m_route)
+    {
+        Metrics::GetInstance().RecordRoute(response_.m_route, (boost::posix_time::microsec_clock::universal_time()-response_.m_started).total_microseconds());
+        response_.m_route = NULL;
+    }
 }
 
-void Connection::_ReceiveData (const boost::system::error_code& error_, size_t dataLength_)
+void Connection::_FoldSubRequests ()
 {
-    if (error_)
+    // A parent cannot be written out before every sub-request is folded in, and the sub-requests
+    // always follow it, so going backwards folds a split list inside a batch in a single pass.
+    // The folded sub-requests stay in place as empty ready responses, nothing moves under a write.
+    for (size_t i = m_responses.size(); m_subRequests && i-- > 0;)
     {
-        delete this;
-        return;
+        Response& response = m_responses[i];
+        if (!response.m_parentOffset || !response.m_isReady || response.m_subIndexes.empty())
+        {
+            continue;
+        }
+
+        Response& parent = m_responses[i-response.m_parentOffset];
+        boost::shared_ptr<std::string> part;
+        if (parent.m_isBatch)
+        {
+            uint32 code = 502;
+            size_t bodyStart = response.m_data.find("\r\n\r\n");
+            if (response.m_data.size() > 12 && bodyStart != std::string::npos)
+            {
+                code = atoi(response.m_data.c_str()+9);
+                bodyStart += 4;
+            }
+
+            std::string items;
+            for (size_t j = 0; j < response.m_subIndexes.size(); j++)
+            {
+                if (parent.m_subFolded++)
+                {
+                    items.push_back(',');
+                }
+                items.append("{\"index\":");
+                items.append(boost::lexical_cast<std::string>(response.m_subIndexes[j]));
+                items.append(", \"path\":");
+                AppendJsonString(items, response.m_subPath);
+                items.append(", \"code\":");
+                items.append(boost::lexical_cast<std::string>(code));
+                items.append(", \"response\":");
+                if (code != 502 && bodyStart < response.m_data.size())
+                {
+                    items.append(response.m_data, bodyStart, std::string::npos);
+                }
+                else
+                {
+                    items.append("null");
+                }
+                items.push_back('}');
+            }
+
+            part.reset(new std::string);
+            AppendChunk(*part, items);
+        }
+        else
+        {
+            parent.m_list->m_parts[response.m_subIndexes[0]].swap(response.m_data);
+        }
+
+        _RecordLatency(response);
+        response.m_data.clear();
+        response.m_subIndexes.clear();
+        m_subRequests--;
+        if (--parent.m_subPending == 0)
+        {
+            if (parent.m_isBatch)
+            {
+                AppendChunk(*part, "]}");
+                part->append("0\r\n\r\n");
+            }
+            else
+            {
+                Request::MergeLists(*parent.m_list, parent.m_data);
+                parent.m_list.reset();
+            }
+            parent.m_isReady = true;
+        }
+        if (part)
+        {
+            parent.m_parts.push_back(part);
+        }
+    }
+}
+
+void Connection::_CompleteTask (uint32 taskID_, std::string* response_)
+{
+    m_pendingPosts--;
+    for (std::deque<Response>::iterator it = m_responses.begin(); !m_isClosing && it != m_responses.end(); it++)
+    {
+        if ((*it).m_hasTask && (*it).m_taskID == taskID_)
+        {
+            (*it).m_hasTask = false;
+            std::string decoded;
+            if (!(*it).m_acceptsGzip && ContentEncoding::Inflate(*response_, decoded))
+            {
+                response_->swap(decoded);
+            }
+            (*it).m_data.swap(*response_);
+            (*it).m_isReady = true;
+            _SendResponses();
+            break;
+        }
     }
+    delete response_;
+    _TryRelease();
+}
 
-    if (dataLength_ >= 4 && strncmp(&m_bufferData[0], "GET ", 4) == 0)
+void Connection::_StreamTask (uint32 taskID_, boost::shared_ptr<const std::string> part_, bool isLast_)
+{
+    m_pendingPosts--;
+    for (std::deque<Response>::iterator it = m_responses.begin(); !m_isClosing && it != m_responses.end(); it++)
     {
-        if (!Workers::GetInstance().HasAvailableWorker())
+        Response& response = *it;
+        if (!response.m_hasTask || response.m_taskID != taskID_)
+        {
+            continue;
+        }
+
+        if (!response.m_acceptsGzip)
         {
-            const char service_unavailable[] = "HTTP/1.1 503 Service Unavailable\r\n"
-                "Content-Length: 40\r\n"
-                "Content-Type: application/json\r\n"
-                "Connection: close\r\n"
-                "\r\n"
-                "{\"success\":false, \"code\":503, \"data\":{}}\r\n";
-            SendAndRelease(service_unavailable, strlen(service_unavailable));
+            // Decoding needs the whole body, the parts are gathered first.
+            response.m_data.append(*part_);
+            if (isLast_)
+            {
+                std::string decoded;
+                if (ContentEncoding::Inflate(response.m_data, decoded))
+                {
+                    response.m_data.swap(decoded);
+                }
+            }
+        }
+        else
+        {
+            if (!response.m_isStreaming && !response.m_keepAlive)
+            {
+                boost::shared_ptr<std::string> headers(new std::string(*part_));
+                size_t statusEnd = headers->find("\r\n");
+                if (statusEnd != std::string::npos)
+                {
+                    headers->insert(statusEnd+2, "Connection: close\r\n");
+                }
+                part_ = headers;
+            }
+            response.m_isStreaming = true;
+            response.m_parts.push_back(part_);
+        }
+
+        if (isLast_)
+        {
+            response.m_hasTask = false;
+            response.m_isReady = true;
         }
-        else if (!Request::ParseRequest(&m_bufferData[4], dataLength_-4, this))
+        _SendResponses();
+        break;
+    }
+    _TryRelease();
+}
+
+void Connection::_AbortTask (uint32 taskID_)
+{
+    m_pendingPosts--;
+    for (std::deque<Response>::iterator it = m_responses.begin(); !m_isClosing && it != m_responses.end(); it++)
+    {
+        if ((*it).m_hasTask && (*it).m_taskID == taskID_)
         {
-            const char bad_request[] = "HTTP/1.1 400 Bad Request\r\n"
-                "Content-Length: 40\r\n"
-                "Content-Type: application/json\r\n"
-                "Connection: close\r\n"
-                "\r\n"
-                "{\"success\":false, \"code\":400, \"data\":{}}\r\n";
-            SendAndRelease(bad_request, strlen(bad_request));
+            if ((*it).m_parentOffset)
+            {
+                // Nothing of a sub-request was written yet, it can still fail on its own.
+                (*it).m_hasTask = false;
+                (*it).m_data = Request::s_requestTimeout;
+                (*it).m_isReady = true;
+                _SendResponses();
+                break;
+            }
+            _Close();
+            break;
         }
     }
+    _TryRelease();
+}
+
+void Connection::_RelayTask (uint32 taskID_, Worker* worker_, std::string* headers_, uint32 remaining_)
+{
+    m_pendingPosts--;
+    std::deque<Response>::iterator it = m_responses.begin();
+    while (it != m_responses.end() && !((*it).m_hasTask && (*it).m_taskID == taskID_))
+    {
+        it++;
+    }
+
+    if (m_isClosing || it == m_responses.end())
+    {
+        worker_->EndRelay(remaining_, true, false);
+    }
     else
     {
-        const char service_unavailable[] = "HTTP/1.1 503 Service Unavailable\r\n"
-                "Content-Length: 40\r\n"
-                "Content-Type: application/json\r\n"
-                "Connection: close\r\n"
-                "\r\n"
-                "{\"success\":false, \"code\":503, \"data\":{}}\r\n";
-        SendAndRelease(service_unavailable, strlen(service_unavailable));
+        Response& response = *it;
+        if (!response.m_keepAlive)
+        {
+            size_t statusEnd = headers_->find("\r\n");
+            if (statusEnd != std::string::npos)
+            {
+                headers_->insert(statusEnd+2, "Connection: close\r\n");
+            }
+        }
+        response.m_hasTask = false;
+        response.m_isStreaming = true;
+        response.m_parts.push_back(boost::shared_ptr<const std::string>(headers_));
+        headers_ = NULL;
+        response.m_relayWorker = worker_;
+        response.m_relayRemaining = remaining_;
+        _SendResponses();
     }
+    delete headers_;
+    _TryRelease();
 }
 
-void Connection::_HandleErrors (const boost::system::error_code& error_, size_t dataLength_)
+void Connection::_Relay ()
+{
+#ifdef SPLICE_F_MOVE
+    Response& response = m_responses.front();
+    int workerSocket = response.m_relayWorker->GetSocket().native_handle();
+    while (response.m_relayRemaining || m_relayPiped)
+    {
+        if (m_relayPiped == 0)
+        {
+            ssize_t length = splice(workerSocket, NULL, response.m_relayWorker->GetRelayPipe(1), NULL, std::min<uint32>(response.m_relayRemaining, CONNECTION_RELAY_CHUNK), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (length < 0 && errno == EAGAIN)
+            {
+                // The worker socket is only used on the worker strand.
+                response.m_relayWorker->WaitRelay(this);
+                return;
+            }
+            if (length <= 0)
+            {
+                _EndRelay(true);
+                return;
+            }
+            response.m_relayRemaining -= length;
+            m_relayPiped += length;
+        }
+
+        ssize_t length = splice(response.m_relayWorker->GetRelayPipe(0), NULL, m_socket.native_handle(), NULL, m_relayPiped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (length < 0 && errno == EAGAIN)
+        {
+            m_socket.async_write_some(boost::asio::null_buffers(),
+                m_strand.wrap(boost::bind(&Connection::_RelayReady, this, boost::asio::placeholders::error, false)));
+            return;
+        }
+        if (length <= 0)
+        {
+            _EndRelay(false);
+            return;
+        }
+        m_relayPiped -= length;
+        Metrics::GetInstance().Increment(Metrics::Counter_RelayedBytes, length);
+    }
+#endif
+    _EndRelay(false);
+}
+
+void Connection::_RelayReady (const boost::system::error_code& error_, bool isWorker_)
 {
     if (error_)
     {
-        if (m_isSending && m_sendDataLength > 0)
+        _EndRelay(isWorker_);
+        return;
+    }
+    _Relay();
+}
+
+void Connection::_RelayReadable (const boost::system::error_code& error_)
+{
+    m_pendingPosts--;
+    _RelayReady(error_, true);
+}
+
+void Connection::_RelayTimerExpired (const boost::system::error_code& error_)
+{
+    m_strand.dispatch(boost::bind(&Connection::_RelayTimeOut, this, error_));
+}
+
+void Connection::_RelayTimeOut (const boost::system::error_code& error_)
+{
+    m_pendingTimers--;
+    if (!error_ && m_isRelaying)
+    {
+        // The shutdown ends the relay, the worker skips the rest of the body.
+        _Close();
+        return;
+    }
+    _TryRelease();
+}
+
+void Connection::_EndRelay (bool workerFailed_)
+{
+    m_relayTimer.Cancel();
+    Response& response = m_responses.front();
+    bool isComplete = (response.m_relayRemaining == 0 && m_relayPiped == 0);
+    response.m_relayWorker->EndRelay(workerFailed_ ? 0 : response.m_relayRemaining, m_relayPiped == 0, workerFailed_);
+    response.m_relayWorker = NULL;
+    m_relayPiped = 0;
+    m_isRelaying = false;
+    if (!isComplete || m_isClosing)
+    {
+        _Close();
+        return;
+    }
+
+    bool keepAlive = response.m_keepAlive;
+    _RecordLatency(response);
+    m_responses.pop_front();
+    _ResponsesSent(keepAlive);
+}
+
+void Connection::_SendResponses ()
+{
+    _FoldSubRequests();
+
+    if (m_isSending || m_isClosing || m_isRelaying)
+    {
+        m_relayableTask.store(0, boost::memory_order_release);
+        return;
+    }
+
+    // A relayed response takes the socket once its headers are written.
+    if (!m_responses.empty() && m_responses.front().m_relayWorker && m_responses.front().m_parts.empty())
+    {
+        m_relayableTask.store(0, boost::memory_order_release);
+        m_isRelaying = true;
+        m_pendingTimers++;
+        TimerWheel::Get(m_shard).Schedule(m_relayTimer, CONNECTION_RELAY_TIMEOUT);
+        _Relay();
+        return;
+    }
+
+    // Gathers every ready response at the front, and what arrived of the streamed one that
+    // follows them, into a single write, so they go out in order with one completion.
+    // Nothing is queued after a response that closes the connection.
+    m_writeBuffers.clear();
+    m_sendingLength = 0;
+    m_sendingCount = 0;
+    for (std::deque<Response>::iterator it = m_responses.begin(); it != m_responses.end(); it++)
+    {
+        Response& response = *it;
+        if (response.m_isStreaming)
+        {
+            for (std::deque<boost::shared_ptr<const std::string>>::iterator part = response.m_parts.begin(); part != response.m_parts.end(); part++)
+            {
+                m_writeBuffers.push_back(boost::asio::buffer(**part));
+                m_sendingLength += (*part)->length();
+            }
+            response.m_sendingParts = response.m_parts.size();
+        }
+        else if (response.m_isReady)
         {
-            m_sendDataLength -= dataLength_;
-            if (m_sendDataLength == 0)
+            if (!response.m_keepAlive)
             {
-                delete this;
+                size_t statusEnd = response.m_data.find("\r\n");
+                if (statusEnd != std::string::npos)
+                {
+                    response.m_data.insert(statusEnd+2, "Connection: close\r\n");
+                }
             }
+            m_writeBuffers.push_back(boost::asio::buffer(response.m_data));
+            m_sendingLength += response.m_data.length();
+        }
+
+        if (!response.m_isReady)
+        {
+            break;
         }
-        else if (!m_isSending)
+        m_sendingCount++;
+        if (!response.m_keepAlive)
         {
-            delete this;
+            break;
         }
     }
-    else
+
+    if (m_writeBuffers.empty() && m_sendingCount == 0)
+    {
+        // Nothing goes out before the task the front response waits for, its worker may relay it.
+        uint64 relayable = 0;
+        if (!m_responses.empty() && m_responses.front().m_hasTask && !m_responses.front().m_isStreaming)
+        {
+            relayable = (uint64)1 << 32 | m_responses.front().m_taskID;
+        }
+        m_relayableTask.store(relayable, boost::memory_order_release);
+        return;
+    }
+
+    m_relayableTask.store(0, boost::memory_order_release);
+    m_isSending = true;
+    boost::asio::async_write(m_socket, m_writeBuffers,
+        m_strand.wrap(boost::bind(&Connection::_HandleErrors, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void Connection::_HandleErrors (const boost::system::error_code& error_, size_t dataLength_)
+{
+    m_isSending = false;
+    if (error_ || dataLength_ != m_sendingLength || m_isClosing)
+    {
+        _Close();
+        return;
+    }
+
+    bool keepAlive = true;
+    for (uint32 i = 0; i < m_sendingCount; i++)
+    {
+        keepAlive = m_responses.front().m_keepAlive;
+        _RecordLatency(m_responses.front());
+        m_responses.pop_front();
+    }
+    m_sendingCount = 0;
+
+    // The streamed response still running drops the parts just written.
+    if (keepAlive && !m_responses.empty() && m_responses.front().m_sendingParts)
+    {
+        Response& response = m_responses.front();
+        response.m_parts.erase(response.m_parts.begin(), response.m_parts.begin()+response.m_sendingParts);
+        response.m_sendingParts = 0;
+    }
+    _ResponsesSent(keepAlive);
+}
+
+void Connection::_ResponsesSent (bool keepAlive_)
+{
+    if (!keepAlive_)
+    {
+        _Close();
+        return;
+    }
+
+    _ProcessBuffer();
+    _SendResponses();
+    _Read();
+
+    if (m_responses.empty() && m_isReading)
+    {
+        _ArmIdleTimer();
+    }
+}
+
+void Connection::_ArmIdleTimer ()
+{
+    m_pendingTimers++;
+    TimerWheel::Get(m_shard).Schedule(m_idleTimer, CONNECTION_IDLE_TIMEOUT);
+}
+
+void Connection::_IdleTimerExpired (const boost::system::error_code& error_)
+{
+    m_strand.dispatch(boost::bind(&Connection::_IdleTimeOut, this, error_));
+}
+
+void Connection::_IdleTimeOut (const boost::system::error_code& error_)
+{
+    m_pendingTimers--;
+    if (!error_ && m_responses.empty())
+    {
+        _Close();
+        return;
+    }
+    _TryRelease();
+}
+
+void Connection::_Close ()
+{
+    if (!m_isClosing)
     {
-        if (m_isSending && m_sendDataLength > 0)
+        m_isClosing = true;
+        m_relayableTask.store(0, boost::memory_order_release);
+        m_idleTimer.Cancel();
+        boost::system::error_code error;
+        if (m_isRelaying)
+        {
+            // _Relay() still uses the descriptor, it sees the shutdown and ends the relay.
+            m_socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, error);
+        }
+        else
+        {
+            CloseConnection();
+        }
+
+        // Detaches the tasks still running, they will not call CompleteTask() anymore.
+        for (std::deque<Response>::iterator it = m_responses.begin(); it != m_responses.end(); it++)
         {
-            m_sendDataLength -= dataLength_;
-            if (m_sendDataLength == 0)
+            // Relays not started give the worker socket back right away.
+            if ((*it).m_relayWorker && !(m_isRelaying && it == m_responses.begin()))
+            {
+                (*it).m_relayWorker->EndRelay((*it).m_relayRemaining, true, false);
+                (*it).m_relayWorker = NULL;
+            }
+            if ((*it).m_hasTask)
             {
-                delete this;
+                if (Task* task = TaskHolder::GetInstance().Find((*it).m_taskID))
+                {
+                    boost::lock_guard<boost::mutex> lock(task->GetMutex(), boost::adopt_lock);
+                    task->DetachConnection(this);
+                }
+                (*it).m_hasTask = false;
             }
         }
     }
-}
\ No newline at end of file
+    _TryRelease();
+}
+
+void Connection::_ReleaseBuffer ()
+{
+    if (m_bufferData)
+    {
+        ConnectionPool::GetInstance().ReleaseBuffer(m_shard, m_bufferData);
+        m_bufferData = nullptr;
+    }
+}
+
+void Connection::_TryRelease ()
+{
+    // Every pending handler holds this connection, so it only goes away after the last one returns.
+    if (m_isClosing && !m_isReading && !m_isSending && !m_isRelaying && m_pendingTimers == 0 && m_pendingPosts == 0)
+    {
+        ConnectionPool::GetInstance().FreeConnection(this);
+    }
+}
@@ -2,42 +2,201 @@
 #define _CONNECTION_H_
 
 #include <boost/asio.hpp>
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <deque>
+#include <vector>
+#include <string>
 #include "workers.h"
+#include "httpParser.h"
+#include "timerWheel.h"
+
+#define CONNECTION_BUFFER_SIZE          65535
+// Bytes moved by one splice(2) call of a relay.
+#define CONNECTION_RELAY_CHUNK          65536
+// Milliseconds a relay may hold the worker socket, a client reading slower is closed.
+#define CONNECTION_RELAY_TIMEOUT        5000
 
 class Task;
+class Worker;
+struct ListRequest;
+struct Route;
 
 class Connection
 {
 public:
-    Connection (boost::asio::io_service& io_service_);
+    Connection (boost::asio::io_service& io_service_, uint32 shard_);
     ~Connection ();
 
     boost::asio::ip::tcp::socket& GetSocket ();
-    
+
     void CloseConnection ();
 
     void MainLoop ();
 
-    void SendData (const char* data_, size_t dataLength_);
-
+    // Answers the request being handled with an already built response.
     void SendAndRelease (const char* data_, size_t dataLength_);
 
     void SetRelatedTask (Task* task_);
 
+    // Answers the request related to a task, can be called from any thread.
+    // The response is swapped out of response_.
+    void CompleteTask (uint32 taskID_, std::string& response_);
+
+    // Forwards the next part of a task response, the first part holds the headers. The parts
+    // are shared between the connections waiting for the task, can be called from any thread.
+    void StreamTask (uint32 taskID_, const boost::shared_ptr<const std::string>& part_, bool isLast_);
+
+    // Closes the connection if it waits for the task, a response already started cannot be replaced.
+    void AbortTask (uint32 taskID_);
+
+    ///
+    /// Sends a task response whose body is still in the worker socket. Once the responses before it
+    /// are written, the body goes from the worker socket to this socket through the worker pipe
+    /// with splice(2), then Worker::EndRelay() gives the worker socket back.
+    /// @param[in] headers_ The headers and the part of the body the worker already read.
+    /// @param[in] remaining_ Body bytes still in the worker socket.
+    ///
+    void RelayTask (uint32 taskID_, Worker* worker_, const std::string& headers_, uint32 remaining_);
+
+    // Whether the response of taskID_ is at the front with nothing written before it, so a relay
+    // would start right away. Can be called from any thread.
+    bool CanRelay (uint32 taskID_) const;
+
+    // The worker socket of the relay is readable, called by the worker on its strand.
+    void RelayReadable (const boost::system::error_code& error_);
+
+    static bool IsSpliceSupported ();
+
     boost::asio::io_service& GetIOService ();
 
+    uint32 GetShard () const;
+
+    // Whether the request being handled takes gzip encoded responses.
+    bool AcceptsGzip () const;
+
+    // The latency of the request being handled is recorded for route_ once its response is written.
+    void SetRequestRoute (const Route* route_);
+
+    ///
+    /// Answers the request being handled with the merge of the parts of list_, see Request::MergeLists().
+    /// Every AddListPart() then opens the sub-request of the next part, the following dispatch answers it.
+    ///
+    void SplitList (const boost::shared_ptr<ListRequest>& list_);
+    void AddListPart (uint32 index_);
+
 private:
+    struct Response
+    {
+        Response (bool keepAlive_, bool acceptsGzip_)
+         :m_taskID(0),
+         m_hasTask(false),
+         m_isReady(false),
+         m_keepAlive(keepAlive_),
+         m_acceptsGzip(acceptsGzip_),
+         m_isStreaming(false),
+         m_sendingParts(0),
+         m_relayWorker(NULL),
+         m_relayRemaining(0),
+         m_isBatch(false),
+         m_subPending(0),
+         m_subFolded(0),
+         m_parentOffset(0),
+         m_route(NULL),
+         m_started(boost::posix_time::microsec_clock::universal_time())
+        {};
+        uint32 m_taskID;
+        bool m_hasTask;
+        std::string m_data;
+        bool m_isReady;
+        bool m_keepAlive;
+        bool m_acceptsGzip;
+        // Streamed responses are written part by part, m_isReady once the last part is in.
+        bool m_isStreaming;
+        std::deque<boost::shared_ptr<const std::string>> m_parts;
+        uint32 m_sendingParts;
+        // The body follows the parts straight from this worker socket.
+        Worker* m_relayWorker;
+        uint32 m_relayRemaining;
+        // Response assembled from sub-requests, a batch or a split list: the sub-requests not
+        // folded in yet and the ones already folded.
+        bool m_isBatch;
+        uint32 m_subPending;
+        uint32 m_subFolded;
+        // Split list: gets the response of every part, merged once the last one is in.
+        boost::shared_ptr<ListRequest> m_list;
+        // Sub-request: never written itself, its response is folded into the response m_parentOffset
+        // slots before it. The indexes are its positions in the parent, cleared once folded.
+        uint32 m_parentOffset;
+        std::vector<uint32> m_subIndexes;
+        std::string m_subPath;
+        const Route* m_route;
+        boost::posix_time::ptime m_started;
+    };
+
+    void _Read ();
+    void _ReadReady (const boost::system::error_code& error_);
     void _ReceiveData (const boost::system::error_code& error_, size_t dataLength_);
+    void _ProcessBuffer ();
+    void _HandleRequest (const char* body_, uint32 bodyLength_);
+    void _HandleBatch (const char* body_, uint32 bodyLength_);
+    void _PushSubRequest (size_t parent_);
+    void _RecordLatency (Response& response_);
+    void _FoldSubRequests ();
+    void _CompleteTask (uint32 taskID_, std::string* response_);
+    void _StreamTask (uint32 taskID_, boost::shared_ptr<const std::string> part_, bool isLast_);
+    void _AbortTask (uint32 taskID_);
+    void _RelayTask (uint32 taskID_, Worker* worker_, std::string* headers_, uint32 remaining_);
+    void _Relay ();
+    void _RelayReady (const boost::system::error_code& error_, bool isWorker_);
+    void _RelayReadable (const boost::system::error_code& error_);
+    void _RelayTimerExpired (const boost::system::error_code& error_);
+    void _RelayTimeOut (const boost::system::error_code& error_);
+    void _EndRelay (bool workerFailed_);
+    void _ResponsesSent (bool keepAlive_);
+    void _SendResponses ();
     void _HandleErrors (const boost::system::error_code& error_, size_t dataLength_);
+    void _ArmIdleTimer ();
+    void _IdleTimerExpired (const boost::system::error_code& error_);
+    void _IdleTimeOut (const boost::system::error_code& error_);
+    void _Close ();
+    void _ReleaseBuffer ();
+    void _TryRelease ();
 
-    enum { max_length = 65535 };
+    bool m_isReading;
     bool m_isSending;
-    int32 m_sendDataLength;
+    uint32 m_sendingCount;
+    size_t m_sendingLength;
+    bool m_isClosing;
+    // The front response is being relayed, the socket belongs to _Relay().
+    bool m_isRelaying;
+    uint32 m_relayPiped;
+    // Task id of the response CanRelay() accepts, with the bit 32 set, 0 for none.
+    boost::atomic<uint64> m_relayableTask;
+    bool m_acceptRequests;
+    int32 m_pendingTimers;
+    boost::atomic<int32> m_pendingPosts;
     uint m_id;
+    uint32 m_shard;
+    // Sub-requests whose response is not folded into their parent yet.
+    uint32 m_subRequests;
+    // The response being split by SplitList().
+    size_t m_splitParent;
 
     boost::asio::ip::tcp::socket m_socket;
-    char m_bufferData[max_length];
-    Task* m_relatedTask;
+    boost::asio::io_service::strand m_strand;
+    TimerWheel::Timer m_idleTimer;
+    TimerWheel::Timer m_relayTimer;
+    std::deque<Response> m_responses;
+    std::vector<boost::asio::const_buffer> m_writeBuffers;
+    HttpParser m_parser;
+    // Borrowed from the ConnectionPool while there is data to parse.
+    char* m_bufferData;
+    size_t m_bufferLength;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,63 @@
+#include "connectionPool.h"
+
+ConnectionPool::Shard::Shard ()
+    :m_connections(64, 1.5),
+    m_buffers(16, 1.5)
+{
+}
+
+ConnectionPool::ConnectionPool()
+{
+}
+
+Connection* ConnectionPool::CreateConnection (boost::asio::io_service& io_service_, uint32 shard_)
+{
+    Shard& shard = m_shards[shard_];
+    boost::lock_guard<boost::mutex> lock(shard.m_connectionsMutex);
+    return new(shard.m_connections) Connection(io_service_, shard_);
+}
+
+void ConnectionPool::FreeConnection (Connection* connection_)
+{
+    Shard& shard = m_shards[connection_->GetShard()];
+    boost::lock_guard<boost::mutex> lock(shard.m_connectionsMutex);
+    shard.m_connections.Release(connection_);
+}
+
+char* ConnectionPool::AcquireBuffer (uint32 shard_)
+{
+    Shard& shard = m_shards[shard_];
+    boost::lock_guard<boost::mutex> lock(shard.m_buffersMutex);
+    ReadBuffer* buffer = shard.m_buffers.Acquire();
+    return buffer ? buffer->m_data : NULL;
+}
+
+void ConnectionPool::ReleaseBuffer (uint32 shard_, char* buffer_)
+{
+    Shard& shard = m_shards[shard_];
+    boost::lock_guard<boost::mutex> lock(shard.m_buffersMutex);
+    shard.m_buffers.Release((ReadBuffer*)buffer_);
+}
+
+void ConnectionPool::GetStatistics (size_t& connections_, size_t& connectionCapacity_, size_t& buffers_, size_t& bufferCapacity_)
+{
+    connections_ = connectionCapacity_ = buffers_ = bufferCapacity_ = 0;
+    for (uint32 i = 0; i < SERVER_MAX_SHARDS; i++)
+    {
+        Shard& shard = m_shards[i];
+        {
+            boost::lock_guard<boost::mutex> lock(shard.m_connectionsMutex);
+            connections_ += shard.m_connections.GetAcquiredCount();
+            connectionCapacity_ += shard.m_connections.GetCapacity();
+        }
+        boost::lock_guard<boost::mutex> lock(shard.m_buffersMutex);
+        buffers_ += shard.m_buffers.GetAcquiredCount();
+        bufferCapacity_ += shard.m_buffers.GetCapacity();
+    }
+}
+
+ConnectionPool& ConnectionPool::GetInstance()
+{
+    static ConnectionPool instance;
+    return instance;
+}
@@ -0,0 +1,50 @@
+#ifndef _CONNECTIONPOOL_H_
+#define _CONNECTIONPOOL_H_
+
+#include "allocator.h"
+#include "config.h"
+#include "connection.h"
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+///
+/// Recycles the connections and their read buffers, one set of free lists per shard.
+/// A connection only borrows a read buffer while it has data to parse, so an idle keep-alive
+/// connection costs its object and nothing more.
+///
+class ConnectionPool
+{
+public:
+    Connection* CreateConnection (boost::asio::io_service& io_service_, uint32 shard_);
+    void FreeConnection (Connection* connection_);
+
+    char* AcquireBuffer (uint32 shard_);
+    void ReleaseBuffer (uint32 shard_, char* buffer_);
+
+    // Objects acquired and pool capacities, summed over the shards.
+    void GetStatistics (size_t& connections_, size_t& connectionCapacity_, size_t& buffers_, size_t& bufferCapacity_);
+
+    static ConnectionPool& GetInstance();
+private:
+    ConnectionPool();
+
+    struct ReadBuffer
+    {
+        char m_data[CONNECTION_BUFFER_SIZE];
+    };
+
+    struct Shard
+    {
+        Shard ();
+        boost::mutex m_connectionsMutex;
+        utils::MemoryPool<Connection> m_connections;
+        boost::mutex m_buffersMutex;
+        utils::MemoryPool<ReadBuffer> m_buffers;
+        // Keeps two shards off the same cache line.
+        char m_padding[64];
+    };
+
+    Shard m_shards[SERVER_MAX_SHARDS];
+};
+
+#endif
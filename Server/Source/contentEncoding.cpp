@@ -0,0 +1,94 @@
+#include "contentEncoding.h"
+#include "httpParser.h"
+#include <zlib-1.2.8/zlib.h>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#define INFLATE_CHUNK_SIZE              16384
+
+bool ContentEncoding::AcceptsGzip (const HttpParser& request_)
+{
+    // gzip listed on its own wins over *, "gzip;q=0, *" refuses gzip.
+    int32 quality = request_.GetHeaderQuality("Accept-Encoding", "gzip");
+    if (quality < 0)
+    {
+        quality = request_.GetHeaderQuality("Accept-Encoding", "*");
+    }
+    return quality > 0;
+}
+
+bool ContentEncoding::Inflate (const std::string& response_, std::string& decoded_)
+{
+    size_t headersEnd = response_.find("\r\n\r\n");
+    if (headersEnd == std::string::npos)
+    {
+        return false;
+    }
+
+    // Keeps every header line but the ones describing the encoded body.
+    std::string headers;
+    bool isGziped = false;
+    size_t lineStart = 0;
+    while (lineStart < headersEnd)
+    {
+        size_t lineEnd = response_.find("\r\n", lineStart);
+        boost::string_ref line(response_.data()+lineStart, lineEnd-lineStart);
+        if (boost::algorithm::istarts_with(line, "Content-Encoding:"))
+        {
+            isGziped = boost::algorithm::icontains(line, "gzip");
+        }
+        else if (!boost::algorithm::istarts_with(line, "Content-Length:"))
+        {
+            headers.append(line.data(), line.size());
+            headers.append("\r\n");
+        }
+        lineStart = lineEnd+2;
+    }
+    if (!isGziped)
+    {
+        return false;
+    }
+
+    // Streams the body through a fixed size window, 16+MAX_WBITS reads the gzip wrapper.
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.next_in = (Bytef*)(response_.data()+headersEnd+4);
+    stream.avail_in = (uInt)(response_.size()-headersEnd-4);
+    if (inflateInit2(&stream, 16+MAX_WBITS) != Z_OK)
+    {
+        return false;
+    }
+
+    std::string body;
+    body.reserve(stream.avail_in*4);
+    char chunk[INFLATE_CHUNK_SIZE];
+    int result = Z_OK;
+    do
+    {
+        stream.next_out = (Bytef*)chunk;
+        stream.avail_out = sizeof(chunk);
+        result = inflate(&stream, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END)
+        {
+            break;
+        }
+        body.append(chunk, sizeof(chunk)-stream.avail_out);
+    } while (result != Z_STREAM_END && (stream.avail_in != 0 || stream.avail_out == 0));
+    inflateEnd(&stream);
+
+    if (result != Z_STREAM_END)
+    {
+        return false;
+    }
+
+    decoded_.reserve(headers.size()+body.size()+32);
+    decoded_ = headers;
+    decoded_.append("Content-Length: ");
+    decoded_.append(boost::lexical_cast<std::string>(body.size()));
+    decoded_.append("\r\n\r\n");
+    decoded_.append(body);
+    return true;
+}
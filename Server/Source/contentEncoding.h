@@ -0,0 +1,27 @@
+#ifndef _CONTENTENCODING_H_
+#define _CONTENTENCODING_H_
+
+#include "types.h"
+#include <string>
+
+class HttpParser;
+
+///
+/// Content-Encoding negotiation. The workers always answer gzip, clients that cannot inflate
+/// get the response decoded by the server.
+///
+class ContentEncoding
+{
+public:
+    // True if the Accept-Encoding header gives gzip, or * when gzip is not listed, a q-value above 0.
+    static bool AcceptsGzip (const HttpParser& request_);
+
+    ///
+    /// Decodes a complete gzip encoded HTTP response into decoded_, with its Content-Encoding
+    /// header dropped and its Content-Length updated. The other headers are kept.
+    /// @return false if response_ is not gzip encoded or its body is corrupted.
+    ///
+    static bool Inflate (const std::string& response_, std::string& decoded_);
+};
+
+#endif
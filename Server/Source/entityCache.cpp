@@ -0,0 +1,82 @@
+#include "entityCache.h"
+#include <boost/lexical_cast.hpp>
+
+EntityCache::EntityCache ()
+{
+}
+
+bool EntityCache::Find (const std::string& operation_, uint32 id_, std::string& entity_)
+{
+    if (!m_entries.IsEnabled())
+    {
+        return false;
+    }
+
+    std::string key = _GetKey(operation_, id_);
+    uint32 stripe = m_entries.GetStripe(key);
+    boost::lock_guard<boost::mutex> lock(m_entries.GetMutex(stripe));
+    Entry* entry = m_entries.Find(stripe, key);
+    if (!entry)
+    {
+        return false;
+    }
+
+    if (entry->m_expires <= boost::posix_time::microsec_clock::universal_time())
+    {
+        m_entries.Erase(stripe, key);
+        return false;
+    }
+
+    entity_ = entry->m_entity;
+    return true;
+}
+
+void EntityCache::Store (const std::string& operation_, uint32 id_, const std::string& entity_, uint32 ttl_)
+{
+    if (ttl_ == 0 || !m_entries.IsEnabled())
+    {
+        return;
+    }
+
+    std::string key = _GetKey(operation_, id_);
+    uint32 stripe = m_entries.GetStripe(key);
+    boost::lock_guard<boost::mutex> lock(m_entries.GetMutex(stripe));
+    Entry& entry = m_entries.Insert(stripe, key);
+    entry.m_entity = entity_;
+    entry.m_expires = boost::posix_time::microsec_clock::universal_time()+boost::posix_time::seconds(ttl_);
+}
+
+bool EntityCache::FindEnvelope (const std::string& operation_, std::string& prefix_, std::string& suffix_)
+{
+    boost::lock_guard<boost::mutex> lock(m_envelopeMutex);
+    boost::unordered_map<std::string, std::pair<std::string, std::string>>::iterator it = m_envelopes.find(operation_);
+    if (it == m_envelopes.end())
+    {
+        return false;
+    }
+    prefix_ = (*it).second.first;
+    suffix_ = (*it).second.second;
+    return true;
+}
+
+void EntityCache::StoreEnvelope (const std::string& operation_, const std::string& prefix_, const std::string& suffix_)
+{
+    boost::lock_guard<boost::mutex> lock(m_envelopeMutex);
+    m_envelopes[operation_] = std::make_pair(prefix_, suffix_);
+}
+
+void EntityCache::SetCapacity (uint32 entities_)
+{
+    m_entries.SetCapacity(entities_);
+}
+
+std::string EntityCache::_GetKey (const std::string& operation_, uint32 id_)
+{
+    return operation_+"/"+boost::lexical_cast<std::string>(id_);
+}
+
+EntityCache& EntityCache::GetInstance ()
+{
+    static EntityCache instance;
+    return instance;
+}
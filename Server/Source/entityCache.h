@@ -0,0 +1,56 @@
+#ifndef _ENTITYCACHE_H_
+#define _ENTITYCACHE_H_
+
+#include "types.h"
+#include "stripedLru.h"
+#include <string>
+#include <boost/unordered_map.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#define ENTITY_CACHE_STRIPES            16
+
+///
+/// Per-id entries of the list operations (summoner names, icons), so a list request only asks the
+/// workers for the ids it misses. An entity is the JSON text of one element of the "data.body"
+/// array of the worker response. The envelope is that response without its elements, the last one
+/// seen for each operation, used to answer a list found entirely in the cache.
+///
+class EntityCache
+{
+public:
+    bool Find (const std::string& operation_, uint32 id_, std::string& entity_);
+
+    // Keeps the entity for ttl_ seconds.
+    void Store (const std::string& operation_, uint32 id_, const std::string& entity_, uint32 ttl_);
+
+    // Gets the text before and after the "data.body" array of the last response of operation_.
+    bool FindEnvelope (const std::string& operation_, std::string& prefix_, std::string& suffix_);
+
+    void StoreEnvelope (const std::string& operation_, const std::string& prefix_, const std::string& suffix_);
+
+    // Bounds the number of entities, the least recently used ones are dropped first. Must be set
+    // before the I/O threads start, the cache is disabled until then.
+    void SetCapacity (uint32 entities_);
+
+    static EntityCache& GetInstance ();
+
+private:
+    EntityCache ();
+
+    struct Entry
+    {
+        std::string m_entity;
+        boost::posix_time::ptime m_expires;
+    };
+
+    static std::string _GetKey (const std::string& operation_, uint32 id_);
+
+    StripedLru<Entry, ENTITY_CACHE_STRIPES> m_entries;
+
+    boost::mutex m_envelopeMutex;
+    boost::unordered_map<std::string, std::pair<std::string, std::string>> m_envelopes;
+};
+
+#endif
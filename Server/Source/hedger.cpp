@@ -0,0 +1,107 @@
+#include "hedger.h"
+#include "taskTimeouts.h"
+#include "routes.h"
+#include "taskHolder.h"
+#include "task.h"
+#include "workers.h"
+#include "timerWheel.h"
+#include <boost/bind.hpp>
+#include <algorithm>
+
+Hedger::Hedger ()
+    :m_budget(0),
+    m_tokens(0)
+{
+}
+
+void Hedger::SetBudget (uint32 percent_)
+{
+    m_budget = std::min<uint32>(percent_, 100);
+}
+
+bool Hedger::IsEnabled () const
+{
+    return m_budget != 0;
+}
+
+void Hedger::Schedule (const Route& route_, uint32 shard_, uint32 taskID_, uint32 workerUID_, const char* message_, size_t messageLength_)
+{
+    if (!m_budget || !workerUID_ || !route_.m_isIdempotent)
+    {
+        return;
+    }
+
+    uint32 tokens = m_tokens.load(boost::memory_order_relaxed);
+    uint32 refilled = 0;
+    do
+    {
+        refilled = std::min<uint32>(tokens+m_budget, HEDGE_BURST*100);
+    }
+    while (refilled != tokens && !m_tokens.compare_exchange_weak(tokens, refilled, boost::memory_order_relaxed));
+    // Checked again when the hedge fires, the tokens may be spent by then.
+    if (refilled < 100)
+    {
+        return;
+    }
+
+    uint32 delay = TaskTimeouts::GetInstance().GetHedgeDelay(&route_);
+    if (!delay)
+    {
+        return;
+    }
+    Hedge* hedge = new Hedge;
+    hedge->m_shard = shard_;
+    hedge->m_taskID = taskID_;
+    hedge->m_workerUID = workerUID_;
+    hedge->m_message.assign(message_, messageLength_);
+    hedge->m_timer.SetHandler(boost::bind(&Hedger::_Hedge, hedge, boost::asio::placeholders::error));
+    TimerWheel::Get(shard_).Schedule(hedge->m_timer, delay);
+}
+
+void Hedger::_Hedge (Hedge* hedge_, const boost::system::error_code& error_)
+{
+    if (!error_)
+    {
+        GetInstance()._Send(*hedge_);
+    }
+    delete hedge_;
+}
+
+void Hedger::_Send (const Hedge& hedge_)
+{
+    // Only a task nobody started to answer yet, it may be gone by now.
+    Task* task = TaskHolder::GetInstance().Find(hedge_.m_taskID);
+    if (!task)
+    {
+        return;
+    }
+    bool isWaiting = false;
+    {
+        boost::lock_guard<boost::mutex> lock(task->GetMutex(), boost::adopt_lock);
+        isWaiting = task->IsWaitingForWorker();
+    }
+
+    if (isWaiting && _TakeToken())
+    {
+        Workers::GetInstance().SendToAvailableWorker(hedge_.m_shard, hedge_.m_message.data(), hedge_.m_message.size(), hedge_.m_workerUID);
+    }
+}
+
+bool Hedger::_TakeToken ()
+{
+    uint32 tokens = m_tokens.load(boost::memory_order_relaxed);
+    while (tokens >= 100)
+    {
+        if (m_tokens.compare_exchange_weak(tokens, tokens-100, boost::memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+Hedger& Hedger::GetInstance ()
+{
+    static Hedger instance;
+    return instance;
+}
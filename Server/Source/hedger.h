@@ -0,0 +1,60 @@
+#ifndef _HEDGER_H_
+#define _HEDGER_H_
+
+#include "types.h"
+#include "timerWheel.h"
+#include <string>
+#include <boost/atomic.hpp>
+
+// Hedges the budget can save up during quiet periods, sent back to back when workers stall.
+#define HEDGE_BURST                     20
+
+struct Route;
+
+///
+/// Hedged requests: a task still unanswered after the p95 latency of its route is sent again to
+/// another worker, the first response wins and the other one is skipped by its worker. The hedges
+/// are bounded by a token bucket, every task adds budget_ percent of a hedge to it.
+/// Only the idempotent routes are hedged, /numeric forwards any operation and is sent once.
+///
+class Hedger
+{
+public:
+    // Percent of extra tasks hedging may add, 0 disables it.
+    void SetBudget (uint32 percent_);
+
+    bool IsEnabled () const;
+
+    ///
+    /// Arms the hedge of a task just sent to a worker, can be called from any thread.
+    /// Nothing is armed when the bucket cannot pay for a hedge.
+    /// @param[in] workerUID_ The worker the task went to, the hedge goes to another one.
+    /// @param[in] message_ The task message, copied if the route has a hedge delay.
+    ///
+    void Schedule (const Route& route_, uint32 shard_, uint32 taskID_, uint32 workerUID_, const char* message_, size_t messageLength_);
+
+    static Hedger& GetInstance ();
+
+private:
+    Hedger ();
+
+    struct Hedge
+    {
+        TimerWheel::Timer m_timer;
+        uint32 m_shard;
+        uint32 m_taskID;
+        uint32 m_workerUID;
+        std::string m_message;
+    };
+
+    // Static, the bound handler then fits in its timer without allocating.
+    static void _Hedge (Hedge* hedge_, const boost::system::error_code& error_);
+    void _Send (const Hedge& hedge_);
+    bool _TakeToken ();
+
+    uint32 m_budget;
+    // In hundredths of a hedge.
+    boost::atomic<uint32> m_tokens;
+};
+
+#endif
@@ -0,0 +1,419 @@
+#include "httpParser.h"
+#include <string.h>
+#include <algorithm>
+#include <boost/algorithm/string/predicate.hpp>
+
+namespace
+{
+    inline bool IsTokenChar (char c_)
+    {
+        return (c_ > 32 && c_ < 127 && !strchr("()<>@,;:\\\"/[]?={}", c_));
+    }
+
+    inline char ToLower (char c_)
+    {
+        return (c_ >= 'A' && c_ <= 'Z') ? c_+('a'-'A') : c_;
+    }
+
+    boost::string_ref Trim (boost::string_ref text_)
+    {
+        while (!text_.empty() && (text_.front() == ' ' || text_.front() == '\t'))
+        {
+            text_.remove_prefix(1);
+        }
+        while (!text_.empty() && (text_.back() == ' ' || text_.back() == '\t'))
+        {
+            text_.remove_suffix(1);
+        }
+        return text_;
+    }
+}
+
+HttpParser::HttpParser ()
+{
+    Reset();
+}
+
+void HttpParser::Reset ()
+{
+    m_state = s_method;
+    m_data = nullptr;
+    m_position = 0;
+    m_tokenStart = 0;
+    m_minorVersion = 0;
+    m_headerCount = 0;
+    m_method.m_offset = m_method.m_length = 0;
+    m_uri.m_offset = m_uri.m_length = 0;
+    m_version.m_offset = m_version.m_length = 0;
+}
+
+HttpParser::Result HttpParser::Parse (const char* data_, size_t dataLength_)
+{
+    m_data = data_;
+
+    while (m_position < dataLength_)
+    {
+        const char c = data_[m_position];
+        switch (m_state)
+        {
+        case s_method:
+            if (c == ' ' && m_position > 0)
+            {
+                m_method.m_offset = 0;
+                m_method.m_length = m_position;
+                m_tokenStart = m_position+1;
+                m_state = s_uri;
+            }
+            else if (!IsTokenChar(c))
+            {
+                m_state = s_failed;
+                return Failed;
+            }
+            break;
+
+        case s_uri:
+        {
+            // Jumps straight to the end of the target instead of testing it byte by byte.
+            const char* space = (const char*)memchr(data_+m_position, ' ', dataLength_-m_position);
+            const char* last = space ? space : data_+dataLength_;
+            for (const char* ptr = data_+m_position; ptr != last; ++ptr)
+            {
+                if ((unsigned char)*ptr < 32 || *ptr == 127)
+                {
+                    m_state = s_failed;
+                    return Failed;
+                }
+            }
+            if (!space)
+            {
+                m_position = dataLength_;
+                return Incomplete;
+            }
+            m_position = space-data_;
+            if (m_position == m_tokenStart)
+            {
+                m_state = s_failed;
+                return Failed;
+            }
+            m_uri.m_offset = m_tokenStart;
+            m_uri.m_length = m_position-m_tokenStart;
+            m_tokenStart = m_position+1;
+            m_state = s_version;
+            break;
+        }
+
+        case s_version:
+            if (c == '\r' || c == '\n')
+            {
+                m_version.m_offset = m_tokenStart;
+                m_version.m_length = m_position-m_tokenStart;
+                if (!_SetVersion())
+                {
+                    m_state = s_failed;
+                    return Failed;
+                }
+                m_state = (c == '\r') ? s_requestLineEnd : s_headerStart;
+            }
+            else if (m_position-m_tokenStart >= 8)
+            {
+                m_state = s_failed;
+                return Failed;
+            }
+            break;
+
+        case s_requestLineEnd:
+        case s_headerLineEnd:
+            if (c != '\n')
+            {
+                m_state = s_failed;
+                return Failed;
+            }
+            m_state = s_headerStart;
+            break;
+
+        case s_headerStart:
+            if (c == '\r')
+            {
+                m_state = s_requestEnd;
+            }
+            else if (c == '\n')
+            {
+                m_position++;
+                m_state = s_done;
+                return Done;
+            }
+            else if (IsTokenChar(c) && m_headerCount < HTTP_MAX_HEADERS)
+            {
+                m_tokenStart = m_position;
+                m_state = s_headerName;
+            }
+            else
+            {
+                // Line folding is obsolete and too many headers are rejected as well.
+                m_state = s_failed;
+                return Failed;
+            }
+            break;
+
+        case s_headerName:
+            if (c == ':')
+            {
+                m_headers[m_headerCount].m_name.m_offset = m_tokenStart;
+                m_headers[m_headerCount].m_name.m_length = m_position-m_tokenStart;
+                m_state = s_headerValueStart;
+            }
+            else if (!IsTokenChar(c))
+            {
+                m_state = s_failed;
+                return Failed;
+            }
+            break;
+
+        case s_headerValueStart:
+            if (c == ' ' || c == '\t')
+            {
+                break;
+            }
+            m_tokenStart = m_position;
+            m_state = s_headerValue;
+            // Falls through, the value may be empty.
+
+        case s_headerValue:
+        {
+            const char* lineEnd = (const char*)memchr(data_+m_position, '\n', dataLength_-m_position);
+            if (!lineEnd)
+            {
+                m_position = dataLength_;
+                return Incomplete;
+            }
+
+            m_position = lineEnd-data_;
+            uint32 valueEnd = m_position;
+            if (valueEnd > m_tokenStart && data_[valueEnd-1] == '\r')
+            {
+                --valueEnd;
+            }
+            while (valueEnd > m_tokenStart && (data_[valueEnd-1] == ' ' || data_[valueEnd-1] == '\t'))
+            {
+                --valueEnd;
+            }
+
+            m_headers[m_headerCount].m_value.m_offset = m_tokenStart;
+            m_headers[m_headerCount].m_value.m_length = valueEnd-m_tokenStart;
+            m_headerCount++;
+            m_state = s_headerStart;
+            break;
+        }
+
+        case s_requestEnd:
+            if (c != '\n')
+            {
+                m_state = s_failed;
+                return Failed;
+            }
+            m_position++;
+            m_state = s_done;
+            return Done;
+
+        case s_done:
+            return Done;
+
+        case s_failed:
+            return Failed;
+        }
+
+        m_position++;
+    }
+
+    if (m_state == s_done)
+    {
+        return Done;
+    }
+    return (m_state == s_failed) ? Failed : Incomplete;
+}
+
+size_t HttpParser::GetRequestLength () const
+{
+    return m_position;
+}
+
+boost::string_ref HttpParser::GetMethod () const
+{
+    return _View(m_method);
+}
+
+boost::string_ref HttpParser::GetUri () const
+{
+    return _View(m_uri);
+}
+
+boost::string_ref HttpParser::GetPath () const
+{
+    boost::string_ref uri = GetUri();
+    size_t query = uri.find('?');
+    if (query != boost::string_ref::npos)
+    {
+        return uri.substr(0, query);
+    }
+    return uri;
+}
+
+uint32 HttpParser::GetMinorVersion () const
+{
+    return m_minorVersion;
+}
+
+boost::string_ref HttpParser::GetHeader (const char* name_) const
+{
+    size_t nameLength = strlen(name_);
+    for (uint32 i = 0; i < m_headerCount; i++)
+    {
+        boost::string_ref name = _View(m_headers[i].m_name);
+        if (name.size() == nameLength && boost::algorithm::iequals(name, name_))
+        {
+            return _View(m_headers[i].m_value);
+        }
+    }
+    return boost::string_ref();
+}
+
+bool HttpParser::HasHeader (const char* name_) const
+{
+    size_t nameLength = strlen(name_);
+    for (uint32 i = 0; i < m_headerCount; i++)
+    {
+        boost::string_ref name = _View(m_headers[i].m_name);
+        if (name.size() == nameLength && boost::algorithm::iequals(name, name_))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HttpParser::HeaderContains (const char* name_, const char* token_) const
+{
+    return GetHeaderQuality(name_, token_) > 0;
+}
+
+int32 HttpParser::GetHeaderQuality (const char* name_, const char* token_) const
+{
+    boost::string_ref value = GetHeader(name_);
+    size_t tokenLength = strlen(token_);
+
+    while (!value.empty())
+    {
+        size_t comma = value.find(',');
+        boost::string_ref item = value.substr(0, comma);
+        value = (comma == boost::string_ref::npos) ? boost::string_ref() : value.substr(comma+1);
+
+        size_t semicolon = item.find(';');
+        boost::string_ref parameters = (semicolon == boost::string_ref::npos) ? boost::string_ref() : item.substr(semicolon+1);
+        item = Trim(item.substr(0, semicolon));
+        if (item.size() != tokenLength || !boost::algorithm::iequals(item, token_))
+        {
+            continue;
+        }
+
+        // "gzip;q=0.5" is gzip at 500, a missing or malformed q-value counts as 1.
+        while (!parameters.empty())
+        {
+            semicolon = parameters.find(';');
+            boost::string_ref parameter = Trim(parameters.substr(0, semicolon));
+            parameters = (semicolon == boost::string_ref::npos) ? boost::string_ref() : parameters.substr(semicolon+1);
+            if (parameter.size() < 3 || (parameter[0] != 'q' && parameter[0] != 'Q') || parameter[1] != '=')
+            {
+                continue;
+            }
+
+            boost::string_ref q = parameter.substr(2);
+            if (q[0] != '0' && q[0] != '1')
+            {
+                return 1000;
+            }
+            int32 quality = (q[0]-'0')*1000;
+            if (q.size() > 1 && q[1] == '.')
+            {
+                int32 scale = 100;
+                for (size_t i = 2; i < q.size() && i < 5 && q[i] >= '0' && q[i] <= '9'; i++)
+                {
+                    quality += (q[i]-'0')*scale;
+                    scale /= 10;
+                }
+            }
+            return std::min<int32>(quality, 1000);
+        }
+        return 1000;
+    }
+    return -1;
+}
+
+bool HttpParser::IsKeepAlive () const
+{
+    if (m_minorVersion == 0)
+    {
+        return HeaderContains("Connection", "keep-alive");
+    }
+    return !HeaderContains("Connection", "close");
+}
+
+bool HttpParser::GetBodyLength (uint32& length_) const
+{
+    length_ = 0;
+    if (HasHeader("Transfer-Encoding"))
+    {
+        return false;
+    }
+
+    // Two lengths that disagree would let each hop frame the request its own way, it is refused.
+    boost::string_ref value;
+    bool isFound = false;
+    for (uint32 i = 0; i < m_headerCount; i++)
+    {
+        boost::string_ref name = _View(m_headers[i].m_name);
+        if (name.size() != 14 || !boost::algorithm::iequals(name, "Content-Length"))
+        {
+            continue;
+        }
+        boost::string_ref length = Trim(_View(m_headers[i].m_value));
+        if (isFound && value != length)
+        {
+            return false;
+        }
+        value = length;
+        isFound = true;
+    }
+    if (value.size() > 9)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < value.size(); i++)
+    {
+        if (value[i] < '0' || value[i] > '9')
+        {
+            return false;
+        }
+        length_ = length_*10+(value[i]-'0');
+    }
+    return true;
+}
+
+boost::string_ref HttpParser::_View (const Field& field_) const
+{
+    if (!m_data || field_.m_length == 0)
+    {
+        return boost::string_ref();
+    }
+    return boost::string_ref(m_data+field_.m_offset, field_.m_length);
+}
+
+bool HttpParser::_SetVersion ()
+{
+    boost::string_ref version = _View(m_version);
+    if (version.size() != 8 || version.substr(0, 7) != "HTTP/1." || version[7] < '0' || version[7] > '9')
+    {
+        return false;
+    }
+    m_minorVersion = version[7]-'0';
+    return true;
+}
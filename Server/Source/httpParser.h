@@ -0,0 +1,138 @@
+#ifndef _HTTPPARSER_H_
+#define _HTTPPARSER_H_
+
+#include "types.h"
+#include <boost/utility/string_ref.hpp>
+
+#define HTTP_MAX_HEADERS                32
+
+///
+/// Resumable HTTP request parser.
+/// Parse() can be called again every time more data is appended to the request, it resumes from
+/// where the last call stopped and never scans a byte twice. Every field is kept as an offset
+/// into the caller's buffer, so nothing is copied; the views returned by the getters are valid
+/// as long as the request stays at the address given to the last Parse() call.
+///
+class HttpParser
+{
+public:
+    enum Result
+    {
+        Incomplete,
+        Done,
+        Failed
+    };
+
+    HttpParser ();
+
+    ///
+    /// Prepares the parser for a new request.
+    ///
+    void Reset ();
+
+    ///
+    /// Parses the request starting at data_.
+    /// @param[in] data_ Start of the request. Must be the same request on every call, but it may have moved.
+    /// @param[in] dataLength_ Bytes of the request available so far.
+    /// @return Done once the request line and every header were parsed, Incomplete if more data is needed
+    /// and Failed if the request is malformed.
+    ///
+    Result Parse (const char* data_, size_t dataLength_);
+
+    ///
+    /// Gets the number of bytes taken by the request line and headers.
+    ///
+    size_t GetRequestLength () const;
+
+    boost::string_ref GetMethod () const;
+
+    ///
+    /// Gets the request target, query string included.
+    ///
+    boost::string_ref GetUri () const;
+
+    ///
+    /// Gets the request target without the query string.
+    ///
+    boost::string_ref GetPath () const;
+
+    ///
+    /// Gets the minor HTTP version (0 for HTTP/1.0, 1 for HTTP/1.1).
+    ///
+    uint32 GetMinorVersion () const;
+
+    ///
+    /// Gets the value of a header, the name is compared case insensitively.
+    /// @return The header value, or an empty view if the header was not sent.
+    ///
+    boost::string_ref GetHeader (const char* name_) const;
+
+    bool HasHeader (const char* name_) const;
+
+    ///
+    /// Checks if a header contains a token in its comma separated list, e.g. "gzip" in Accept-Encoding.
+    ///
+    bool HeaderContains (const char* name_, const char* token_) const;
+
+    ///
+    /// Gets the q-value of a token in a comma separated header, e.g. "gzip;q=0.5" in Accept-Encoding.
+    /// @return The q-value in thousandths, 1000 if it has none, -1 if the token is not listed.
+    ///
+    int32 GetHeaderQuality (const char* name_, const char* token_) const;
+
+    ///
+    /// Checks if the connection should stay open after answering this request.
+    ///
+    bool IsKeepAlive () const;
+
+    ///
+    /// Gets the length of the body that follows the headers, 0 if the request has none.
+    /// @return false if the body length cannot be known: malformed Content-Length or a Transfer-Encoding.
+    ///
+    bool GetBodyLength (uint32& length_) const;
+
+private:
+    enum State
+    {
+        s_method,
+        s_uri,
+        s_version,
+        s_requestLineEnd,
+        s_headerStart,
+        s_headerName,
+        s_headerValueStart,
+        s_headerValue,
+        s_headerLineEnd,
+        s_requestEnd,
+        s_done,
+        s_failed
+    };
+
+    struct Field
+    {
+        uint32 m_offset;
+        uint32 m_length;
+    };
+
+    struct Header
+    {
+        Field m_name;
+        Field m_value;
+    };
+
+    boost::string_ref _View (const Field& field_) const;
+    bool _SetVersion ();
+
+    State m_state;
+    const char* m_data;
+    uint32 m_position;
+    uint32 m_tokenStart;
+    uint32 m_minorVersion;
+    Field m_method;
+    Field m_uri;
+    Field m_version;
+    uint32 m_headerCount;
+    Header m_headers[HTTP_MAX_HEADERS];
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "listBatcher.h"
+#include "request.h"
+#include "routes.h"
+#include "task.h"
+#include "taskHolder.h"
+#include "connection.h"
+#include "workers.h"
+#include "hedger.h"
+#include "metrics.h"
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+ListBatcher::ListBatcher ()
+    :m_window(0)
+{
+}
+
+void ListBatcher::Add (const Route& route_, const std::vector<uint32>& ids_, const boost::shared_ptr<ListRequest>& list_, uint32 partIndex_, Connection* connection_)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    BatchMap::key_type key(connection_->GetShard(), &route_);
+    Batch& batch = m_batches[key];
+
+    // A connection waits for a task only once, and a worker call takes REQUEST_LIST_PART ids at most.
+    if (batch.m_timer)
+    {
+        size_t newIDs = 0;
+        for (size_t i = 0; i < ids_.size(); i++)
+        {
+            newIDs += (std::find(batch.m_ids.begin(), batch.m_ids.end(), ids_[i]) == batch.m_ids.end());
+        }
+        bool isWaiting = false;
+        for (size_t i = 0; i < batch.m_waiters.size(); i++)
+        {
+            isWaiting |= (batch.m_waiters[i].m_connection == connection_);
+        }
+        if (isWaiting || batch.m_ids.size()+newIDs > REQUEST_LIST_PART)
+        {
+            _Send(batch);
+        }
+    }
+
+    bool isNew = (batch.m_timer == NULL);
+    if (isNew)
+    {
+        batch.m_route = &route_;
+        batch.m_shard = connection_->GetShard();
+        // Task keys are worker messages, which never start with 0xff.
+        batch.m_key = "\xff" + std::string(route_.m_operation) + "/" + boost::lexical_cast<std::string>(batch.m_serial++);
+    }
+
+    CachePolicy policy = { 0, 0 };
+    bool joined = false;
+    Task* task = TaskHolder::GetInstance().CreateTask(route_, connection_, batch.m_key, policy, joined);
+    if (!task)
+    {
+        // Every task slot of the shard is taken, the part fails the whole list.
+        Metrics::GetInstance().Increment(Metrics::Counter_Unavailable);
+        connection_->SendAndRelease(Request::s_serviceUnavailable, strlen(Request::s_serviceUnavailable));
+        return;
+    }
+    if (!joined)
+    {
+        // Also reached if the task of the open batch is gone already, its waiters got their answer.
+        batch.m_taskID = task->GetTaskID();
+        batch.m_ids.clear();
+        batch.m_waiters.clear();
+    }
+
+    for (size_t i = 0; i < ids_.size(); i++)
+    {
+        if (std::find(batch.m_ids.begin(), batch.m_ids.end(), ids_[i]) == batch.m_ids.end())
+        {
+            batch.m_ids.push_back(ids_[i]);
+        }
+    }
+    Waiter waiter;
+    waiter.m_list = list_;
+    waiter.m_partIndex = partIndex_;
+    waiter.m_connection = connection_;
+    batch.m_waiters.push_back(waiter);
+
+    if (batch.m_ids.size() >= REQUEST_LIST_PART)
+    {
+        _Send(batch);
+    }
+    else if (isNew)
+    {
+        batch.m_timer = new boost::asio::deadline_timer(connection_->GetIOService(), boost::posix_time::milliseconds(m_window));
+        batch.m_timer->async_wait(boost::bind(&ListBatcher::_WindowEnd, this, key, batch.m_timer, boost::asio::placeholders::error));
+    }
+}
+
+void ListBatcher::SetWindow (uint32 milliseconds_)
+{
+    m_window = milliseconds_;
+}
+
+bool ListBatcher::IsEnabled () const
+{
+    return m_window != 0;
+}
+
+void ListBatcher::_Send (Batch& batch_)
+{
+    char message[1024];
+    size_t messageLength = Request::WriteListMessage(batch_.m_route->m_destination, batch_.m_route->m_operation, batch_.m_ids, message);
+    *(uint32*)&message[1] = batch_.m_taskID;
+    for (size_t i = 0; i < batch_.m_waiters.size(); i++)
+    {
+        Waiter& waiter = batch_.m_waiters[i];
+        waiter.m_list->m_partIds[waiter.m_partIndex] = batch_.m_ids;
+    }
+    uint32 workerUID = Workers::GetInstance().SendToAvailableWorker(batch_.m_shard, message, messageLength);
+    if (workerUID)
+    {
+        Hedger::GetInstance().Schedule(*batch_.m_route, batch_.m_shard, batch_.m_taskID, workerUID, message, messageLength);
+    }
+    else
+    {
+        // No worker took it, every list waiting for the batch fails now instead of at the timeout.
+        Task* task = TaskHolder::GetInstance().Find(batch_.m_taskID);
+        if (task)
+        {
+            boost::lock_guard<boost::mutex> lock(task->GetMutex(), boost::adopt_lock);
+            std::string response(Request::s_serviceUnavailable);
+            task->Fail(response);
+        }
+        Metrics::GetInstance().Increment(Metrics::Counter_Unavailable);
+    }
+
+    if (batch_.m_timer)
+    {
+        boost::system::error_code error;
+        batch_.m_timer->cancel(error);
+        batch_.m_timer = NULL;
+    }
+    batch_.m_ids.clear();
+    batch_.m_waiters.clear();
+}
+
+void ListBatcher::_WindowEnd (BatchMap::key_type key_, boost::asio::deadline_timer* timer_, const boost::system::error_code& error_)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        // Aborted once the batch was sent full, before the end of its window.
+        Batch& batch = m_batches[key_];
+        if (!error_ && batch.m_timer == timer_)
+        {
+            _Send(batch);
+        }
+    }
+    delete timer_;
+}
+
+ListBatcher& ListBatcher::GetInstance ()
+{
+    static ListBatcher instance;
+    return instance;
+}
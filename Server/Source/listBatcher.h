@@ -0,0 +1,84 @@
+#ifndef _LISTBATCHER_H_
+#define _LISTBATCHER_H_
+
+#include "types.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+class Connection;
+struct Route;
+struct ListRequest;
+
+///
+/// Gathers the short list requests of a route for a few milliseconds, so concurrent lookups of
+/// single summoners become a single worker call. A batch is a task the connections join with its
+/// key while the batch is open. It is sent with the ids of every connection once the window ends
+/// or it holds REQUEST_LIST_PART ids, and Request::MergeLists() picks the ids of each request out
+/// of the shared response.
+///
+class ListBatcher
+{
+public:
+    ///
+    /// Asks for ids_ as part partIndex_ of list_, in the open batch of the route.
+    /// The sub-request of the part must be the response being handled by connection_.
+    ///
+    void Add (const Route& route_, const std::vector<uint32>& ids_, const boost::shared_ptr<ListRequest>& list_, uint32 partIndex_, Connection* connection_);
+
+    // Milliseconds a batch waits for more ids, 0 sends every list right away. Must be set before
+    // the I/O threads start.
+    void SetWindow (uint32 milliseconds_);
+
+    bool IsEnabled () const;
+
+    static ListBatcher& GetInstance ();
+
+private:
+    ListBatcher ();
+
+    struct Waiter
+    {
+        boost::shared_ptr<ListRequest> m_list;
+        uint32 m_partIndex;
+        Connection* m_connection;
+    };
+
+    struct Batch
+    {
+        Batch ()
+         :m_route(NULL),
+         m_shard(0),
+         m_taskID(0),
+         m_serial(0),
+         m_timer(NULL)
+        {};
+        const Route* m_route;
+        uint32 m_shard;
+        uint32 m_taskID;
+        // Makes the task key of every batch of the route unique.
+        uint32 m_serial;
+        std::string m_key;
+        std::vector<uint32> m_ids;
+        std::vector<Waiter> m_waiters;
+        // Set while the batch is open, deleted by its handler.
+        boost::asio::deadline_timer* m_timer;
+    };
+
+    typedef std::map<std::pair<uint32, const Route*>, Batch> BatchMap;
+
+    // m_mutex must be locked.
+    void _Send (Batch& batch_);
+    void _WindowEnd (BatchMap::key_type key_, boost::asio::deadline_timer* timer_, const boost::system::error_code& error_);
+
+    uint32 m_window;
+    boost::mutex m_mutex;
+    // Open batches by shard and route.
+    BatchMap m_batches;
+};
+
+#endif
@@ -1,20 +1,140 @@
 #include "APIserver.h"
 #include "workerServer.h"
+#include "config.h"
+#include "responseCache.h"
+#include "entityCache.h"
+#include "listBatcher.h"
+#include "hedger.h"
+#include "request.h"
+#include "responseStore.h"
+#include "connection.h"
+#include "timerWheel.h"
 
-#define API_ENDPOINT                    9876
-#define WORKERS_ENDPOINT                1331
+#include <signal.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+void RunIOService (boost::asio::io_service& io_service_)
+{
+    // A handler throwing must not take the other threads down with it.
+    for (;;)
+    {
+        try
+        {
+            io_service_.run();
+            break;
+        }
+        catch(std::exception const& e)
+        {
+            printf("%s\n", e.what());
+        }
+    }
+}
+
+// One io_service and thread per shard, nothing but the worker replies crosses them.
+void RunShards (Config& config_)
+{
+    uint32 shardCount = config_.GetIOThreads();
+    std::vector<boost::asio::io_service*> services;
+    std::vector<boost::asio::io_service::work*> works;
+    for (uint32 i = 0; i < shardCount; i++)
+    {
+        services.push_back(new boost::asio::io_service(1));
+        works.push_back(new boost::asio::io_service::work(*services[i]));
+        TimerWheel::Get(i).Start(*services[i]);
+    }
+
+    WorkerServer ws(*services[0], config_.GetWorkersPort());
+
+    std::vector<APIServer*> servers;
+    if (APIServer::IsReusePortSupported())
+    {
+        for (uint32 i = 0; i < shardCount; i++)
+        {
+            std::vector<boost::asio::io_service*> shard(1, services[i]);
+            servers.push_back(new APIServer(shard, i, config_.GetAPIPort(), true));
+        }
+    }
+    else
+    {
+        // A single listener deals the connections to the shards.
+        servers.push_back(new APIServer(services, 0, config_.GetAPIPort(), false));
+    }
+
+    boost::thread_group threads;
+    for (uint32 i = 1; i < shardCount; i++)
+    {
+        threads.create_thread(boost::bind(&RunIOService, boost::ref(*services[i])));
+    }
+    RunIOService(*services[0]);
+    threads.join_all();
+
+    for (uint32 i = 0; i < servers.size(); i++)
+    {
+        delete servers[i];
+    }
+    for (uint32 i = 0; i < shardCount; i++)
+    {
+        delete works[i];
+        delete services[i];
+    }
+}
 
 int main(int argc, char **argv)
 {
     try
     {
+        Config& config = Config::GetInstance();
+        if (!config.Load(CONFIG_FILE))
+        {
+            puts("Could not load " CONFIG_FILE ", using the default settings.");
+        }
+
+        ResponseCache::GetInstance().SetCapacity(config.GetResponseCacheEntries());
+        EntityCache::GetInstance().SetCapacity(config.GetEntityCacheEntries());
+        ListBatcher::GetInstance().SetWindow(config.GetListBatchWindow());
+        Hedger::GetInstance().SetBudget(config.GetHedgeBudget());
+        Request::RegisterRoutes();
+        if (!config.GetStoreDirectory().empty() && !ResponseStore::GetInstance().Open(config.GetStoreDirectory(), config.GetStoreSegmentSize()))
+        {
+            printf("Could not open the response store in %s.\n", config.GetStoreDirectory().c_str());
+        }
+
+        if (config.IsSpliceRelay())
+        {
+            if (!Connection::IsSpliceSupported())
+            {
+                puts("splice(2) is not available, the worker responses are copied.");
+            }
+#ifdef SIGPIPE
+            // splice(2) has no MSG_NOSIGNAL, a client gone in the middle of a relay must not stop the server.
+            signal(SIGPIPE, SIG_IGN);
+#endif
+        }
+
+        if (config.IsSharded())
+        {
+            RunShards(config);
+            ResponseStore::GetInstance().Close();
+            return 0;
+        }
+
         boost::asio::io_service io_service;
+        // Every connection is on shard 0, its wheel is shared by the threads.
+        TimerWheel::Get(0).Start(io_service);
 
-        WorkerServer ws(io_service, WORKERS_ENDPOINT);
+        WorkerServer ws(io_service, config.GetWorkersPort());
 
-        APIServer s(io_service, API_ENDPOINT);
+        APIServer s(io_service, config.GetAPIPort());
 
-        io_service.run();
+        boost::thread_group threads;
+        for (uint32 i = 1; i < config.GetIOThreads(); i++)
+        {
+            threads.create_thread(boost::bind(&RunIOService, boost::ref(io_service)));
+        }
+        RunIOService(io_service);
+        threads.join_all();
+        ResponseStore::GetInstance().Close();
     }
     catch(std::exception const& e)
     {
@@ -25,4 +145,4 @@ int main(int argc, char **argv)
         puts("wtf");
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,213 @@
+#include "metrics.h"
+#include "routes.h"
+#include "workers.h"
+#include "taskHolder.h"
+#include "connectionPool.h"
+#include <stdio.h>
+#include <algorithm>
+#include <boost/lexical_cast.hpp>
+
+Histogram::Histogram ()
+    :m_sum(0)
+{
+    for (uint32 i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+    {
+        m_buckets[i] = 0;
+    }
+}
+
+void Histogram::Record (uint64 microseconds_)
+{
+    m_buckets[_GetBucket(microseconds_)].fetch_add(1, boost::memory_order_relaxed);
+    m_sum.fetch_add(microseconds_, boost::memory_order_relaxed);
+}
+
+void Histogram::Write (std::string& out_, const char* name_, const std::string& labels_) const
+{
+    char line[256];
+    uint64 count = 0;
+    for (uint32 i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+    {
+        count += m_buckets[i].load(boost::memory_order_relaxed);
+        if (i+1 < METRICS_LATENCY_BUCKETS)
+        {
+            sprintf(line, "_bucket{%s,le=\"%.9g\"} %llu\n", labels_.c_str(), _GetUpperBound(i)/1000000.0, (unsigned long long)count);
+        }
+        else
+        {
+            sprintf(line, "_bucket{%s,le=\"+Inf\"} %llu\n", labels_.c_str(), (unsigned long long)count);
+        }
+        out_.append(name_);
+        out_.append(line);
+    }
+    sprintf(line, "_sum{%s} %.6f\n", labels_.c_str(), m_sum.load(boost::memory_order_relaxed)/1000000.0);
+    out_.append(name_);
+    out_.append(line);
+    sprintf(line, "_count{%s} %llu\n", labels_.c_str(), (unsigned long long)count);
+    out_.append(name_);
+    out_.append(line);
+}
+
+uint64 Histogram::GetPercentile (double fraction_, uint64& count_) const
+{
+    uint64 counts[METRICS_LATENCY_BUCKETS];
+    count_ = 0;
+    for (uint32 i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+    {
+        counts[i] = m_buckets[i].load(boost::memory_order_relaxed);
+        count_ += counts[i];
+    }
+    if (count_ == 0)
+    {
+        return 0;
+    }
+
+    uint64 rank = (uint64)(fraction_*count_);
+    uint64 seen = 0;
+    for (uint32 i = 0; i+1 < METRICS_LATENCY_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen > rank)
+        {
+            return _GetUpperBound(i);
+        }
+    }
+    return _GetUpperBound(METRICS_LATENCY_BUCKETS-2);
+}
+
+void Histogram::Reset ()
+{
+    for (uint32 i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+    {
+        m_buckets[i].store(0, boost::memory_order_relaxed);
+    }
+    m_sum.store(0, boost::memory_order_relaxed);
+}
+
+uint32 Histogram::_GetBucket (uint64 microseconds_)
+{
+    if (microseconds_ < 64)
+    {
+        return 0;
+    }
+
+    uint32 octave = 6;
+    while (octave < 63 && (microseconds_ >> (octave+1)))
+    {
+        octave++;
+    }
+    // The bits below the highest one tell the part of the octave.
+    uint32 part = (uint32)(microseconds_ >> (octave-METRICS_LATENCY_SUB_BITS)) & ((1 << METRICS_LATENCY_SUB_BITS)-1);
+    uint32 bucket = 1+((octave-6) << METRICS_LATENCY_SUB_BITS)+part;
+    return std::min<uint32>(bucket, METRICS_LATENCY_BUCKETS-1);
+}
+
+uint64 Histogram::_GetUpperBound (uint32 bucket_)
+{
+    if (bucket_ == 0)
+    {
+        return 64;
+    }
+    uint32 octave = 6+((bucket_-1) >> METRICS_LATENCY_SUB_BITS);
+    uint32 part = (bucket_-1) & ((1 << METRICS_LATENCY_SUB_BITS)-1);
+    return (uint64)((1 << METRICS_LATENCY_SUB_BITS)+part+1) << (octave-METRICS_LATENCY_SUB_BITS);
+}
+
+Metrics::Metrics ()
+    :m_routes(NULL),
+    m_routeCount(0)
+{
+    for (uint32 i = 0; i < Counter_Count; i++)
+    {
+        m_counters[i] = 0;
+    }
+}
+
+void Metrics::Increment (Counter counter_, uint64 value_)
+{
+    m_counters[counter_].fetch_add(value_, boost::memory_order_relaxed);
+}
+
+void Metrics::SetRoutes (const Route* routes_, size_t routeCount_)
+{
+    m_routes = routes_;
+    m_routeCount = std::min<size_t>(routeCount_, METRICS_MAX_ROUTES);
+}
+
+void Metrics::RecordRoute (const Route* route_, uint64 microseconds_)
+{
+    if (!route_ || !m_routes)
+    {
+        return;
+    }
+    size_t index = route_-m_routes;
+    if (index < m_routeCount)
+    {
+        m_routeLatency[index].Record(microseconds_);
+    }
+}
+
+void Metrics::Write (std::string& out_)
+{
+    const char* counters[Counter_Count][2] = {
+        { "lolbuff_requests_total", "HTTP requests received." },
+        { "lolbuff_task_timeouts_total", "Tasks the workers did not answer in time." },
+        { "lolbuff_unavailable_total", "Requests answered 503 Service Unavailable." },
+        { "lolbuff_relayed_bytes_total", "Response bytes forwarded from a worker to the clients, copied or moved with splice(2)." },
+        { "lolbuff_redispatched_total", "Tasks sent to another worker after theirs closed." }
+    };
+    for (uint32 i = 0; i < Counter_Count; i++)
+    {
+        out_.append("# HELP ").append(counters[i][0]).append(" ").append(counters[i][1]).append("\n");
+        out_.append("# TYPE ").append(counters[i][0]).append(" counter\n");
+        out_.append(counters[i][0]).append(" ");
+        out_.append(boost::lexical_cast<std::string>(m_counters[i].load(boost::memory_order_relaxed))).append("\n");
+    }
+
+    out_.append("# HELP lolbuff_request_duration_seconds Time from a request being parsed to its response being written.\n");
+    out_.append("# TYPE lolbuff_request_duration_seconds histogram\n");
+    for (size_t i = 0; i < m_routeCount; i++)
+    {
+        m_routeLatency[i].Write(out_, "lolbuff_request_duration_seconds", std::string("route=\"")+m_routes[i].m_pattern+"\"");
+    }
+
+    out_.append("# HELP lolbuff_worker_duration_seconds Time from a task being sent to a worker to that worker completing its response.\n");
+    out_.append("# TYPE lolbuff_worker_duration_seconds histogram\n");
+    Workers::GetInstance().WriteLatency(out_, "lolbuff_worker_duration_seconds");
+
+    uint32 tasks = 0;
+    uint32 runningTasks = 0;
+    size_t taskCapacity = 0;
+    TaskHolder::GetInstance().GetStatistics(tasks, runningTasks, taskCapacity);
+    size_t connections = 0;
+    size_t connectionCapacity = 0;
+    size_t buffers = 0;
+    size_t bufferCapacity = 0;
+    ConnectionPool::GetInstance().GetStatistics(connections, connectionCapacity, buffers, bufferCapacity);
+
+    char lines[1024];
+    sprintf(lines, "# HELP lolbuff_tasks_running Tasks waiting for a worker response.\n"
+        "# TYPE lolbuff_tasks_running gauge\n"
+        "lolbuff_tasks_running %u\n"
+        "# HELP lolbuff_tasks Tasks held by the TaskHolder, answered ones included until released.\n"
+        "# TYPE lolbuff_tasks gauge\n"
+        "lolbuff_tasks %u\n"
+        "# HELP lolbuff_pool_used Objects acquired from a MemoryPool.\n"
+        "# TYPE lolbuff_pool_used gauge\n"
+        "lolbuff_pool_used{pool=\"tasks\"} %u\n"
+        "lolbuff_pool_used{pool=\"connections\"} %u\n"
+        "lolbuff_pool_used{pool=\"buffers\"} %u\n"
+        "# HELP lolbuff_pool_capacity Objects a MemoryPool holds without growing.\n"
+        "# TYPE lolbuff_pool_capacity gauge\n"
+        "lolbuff_pool_capacity{pool=\"tasks\"} %u\n"
+        "lolbuff_pool_capacity{pool=\"connections\"} %u\n"
+        "lolbuff_pool_capacity{pool=\"buffers\"} %u\n",
+        runningTasks, tasks, tasks, (uint32)connections, (uint32)buffers, (uint32)taskCapacity, (uint32)connectionCapacity, (uint32)bufferCapacity);
+    out_.append(lines);
+}
+
+Metrics& Metrics::GetInstance ()
+{
+    static Metrics instance;
+    return instance;
+}
@@ -0,0 +1,90 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "types.h"
+#include <string>
+#include <boost/atomic.hpp>
+
+// Eight buckets per power of two from 64us to about 67s, at most 12.5% wide, then one for anything longer.
+#define METRICS_LATENCY_SUB_BITS        3
+#define METRICS_LATENCY_BUCKETS         (2+20*(1 << METRICS_LATENCY_SUB_BITS))
+#define METRICS_MAX_ROUTES              64
+
+struct Route;
+
+///
+/// Latency histogram with log-linear buckets, like an HDR histogram with METRICS_LATENCY_SUB_BITS
+/// sub-bucket bits.
+/// Recording is a couple of relaxed atomic increments, safe from any thread without locks nor
+/// allocations.
+///
+class Histogram
+{
+public:
+    Histogram ();
+
+    void Record (uint64 microseconds_);
+
+    ///
+    /// Appends the series in the Prometheus text format, in seconds.
+    /// @param[in] labels_ The labels of the series without braces, e.g. route="/player/{string}".
+    ///
+    void Write (std::string& out_, const char* name_, const std::string& labels_) const;
+
+    ///
+    /// Upper bound of the bucket holding the given fraction of the samples, in microseconds.
+    /// @return 0 without samples, the lower bound of the last bucket if the fraction falls in it.
+    ///
+    uint64 GetPercentile (double fraction_, uint64& count_) const;
+
+    // Samples recorded meanwhile may be lost, only meant for a histogram nobody writes out.
+    void Reset ();
+
+private:
+    static uint32 _GetBucket (uint64 microseconds_);
+    // Upper bound of a bucket, in microseconds. The last bucket has none.
+    static uint64 _GetUpperBound (uint32 bucket_);
+
+    boost::atomic<uint64> m_buckets[METRICS_LATENCY_BUCKETS];
+    boost::atomic<uint64> m_sum;
+};
+
+///
+/// Server wide counters and per route latencies, written out by /server/metrics.
+///
+class Metrics
+{
+public:
+    enum Counter
+    {
+        Counter_Requests,
+        Counter_Timeouts,
+        Counter_Unavailable,
+        Counter_RelayedBytes,
+        Counter_Redispatched,
+        Counter_Count
+    };
+
+    void Increment (Counter counter_, uint64 value_ = 1);
+
+    // Registers the route table, the latency of a route is kept by its position in it.
+    void SetRoutes (const Route* routes_, size_t routeCount_);
+
+    // Time from the request being parsed to its response being written.
+    void RecordRoute (const Route* route_, uint64 microseconds_);
+
+    // Appends every metric of the server in the Prometheus text format.
+    void Write (std::string& out_);
+
+    static Metrics& GetInstance ();
+
+private:
+    Metrics ();
+
+    boost::atomic<uint64> m_counters[Counter_Count];
+    const Route* m_routes;
+    size_t m_routeCount;
+    Histogram m_routeLatency[METRICS_MAX_ROUTES];
+};
+
+#endif
@@ -3,435 +3,342 @@
 #include "taskHolder.h"
 #include "requestTypes.h"
 #include "workers.h"
-#include "worker.h"
 #include "task.h"
 #include "connection.h"
-#include <boost/algorithm/string/replace.hpp>
+#include "httpParser.h"
+#include "routes.h"
+#include "responseCache.h"
+#include "entityCache.h"
+#include "listBatcher.h"
+#include "metrics.h"
+#include "taskTimeouts.h"
+#include "hedger.h"
 #include <boost/lexical_cast.hpp>
-
-bool Request::ParseRequest (char* data_, size_t dataLength_, Connection* connection_)
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <algorithm>
+#include <rapidjson/document.h>
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+
+#define REQUEST_LIST_MAX                1200
+
+const char Request::s_badRequest[] = "HTTP/1.1 400 Bad Request\r\n"
+    "Content-Length: 40\r\n"
+    "Content-Type: application/json\r\n"
+    "\r\n"
+    "{\"success\":false, \"code\":400, \"data\":{}}";
+
+const char Request::s_serviceUnavailable[] = "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 40\r\n"
+    "Content-Type: application/json\r\n"
+    "\r\n"
+    "{\"success\":false, \"code\":503, \"data\":{}}";
+
+const char Request::s_requestTimeout[] = "HTTP/1.1 408 Request Timeout\r\n"
+    "Content-Length: 40\r\n"
+    "Content-Type: application/json\r\n"
+    "\r\n"
+    "{\"success\":false, \"code\":408, \"data\":{}}";
+
+const char Request::s_badGateway[] = "HTTP/1.1 502 Bad Gateway\r\n"
+    "Content-Length: 40\r\n"
+    "Content-Type: application/json\r\n"
+    "\r\n"
+    "{\"success\":false, \"code\":502, \"data\":{}}";
+
+const char Request::s_versionNotSupported[] = "HTTP/1.1 505 HTTP Version Not Supported\r\n"
+    "Content-Length: 40\r\n"
+    "Content-Type: application/json\r\n"
+    "\r\n"
+    "{\"success\":false, \"code\":505, \"data\":{}}";
+
+namespace
 {
-    char* ptr = data_;
-    char* end = data_+dataLength_-1;
-    size_t left = dataLength_;
-
-    if (left >= 8 && strncmp(ptr, "/player/", 8) == 0)
+    bool EncodeString (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
     {
-        size_t playerNameLength = 0;
-        ptr += 8;
-        left -= 8;
-        while (end != ptr+playerNameLength)
-        {
-            if (*(ptr+playerNameLength) == '/')
-            {
-                break;
-            }
-            if (*(ptr+playerNameLength) == ' ' && *(ptr+playerNameLength+1) == 'H' && *(ptr+playerNameLength+2) == 'T' && *(ptr+playerNameLength+3) == 'T' && *(ptr+playerNameLength+4) == 'P')
-            {
-                break;
-            }
-            playerNameLength++;
-        }
-        std::string playerName(ptr, playerNameLength);
-        ptr += playerNameLength;
-        left -= playerNameLength;
+        std::string string = parameters_.m_strings[0];
+        Request::RequestString(route_, route_.m_destination, route_.m_operation, string, connection_);
+        return true;
+    }
 
-        boost::replace_all(playerName, "%20", " ");
+    bool EncodeNumeric (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
+    {
+        Request::RequestNumeric(route_, route_.m_destination, route_.m_operation, parameters_.m_numbers[0], connection_);
+        return true;
+    }
 
-        if (left >= 5 && strncmp(ptr, " HTTP", 5) == 0 || left >= 6 && strncmp(ptr+1, " HTTP", 5) == 0)
-        {
-            RequestString("summonerService", "getSummonerByName", playerName, connection_);
-            return true;
-        }
-        else if (left >= 7 && strncmp(ptr, "/inGame", 7) == 0)
-        {
-            RequestString("gameService", "retrieveInProgressSpectatorGameInfo", playerName, connection_);
-            return true;
-        }
-        else
+    bool EncodeList (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
+    {
+        if (parameters_.m_list.empty() || parameters_.m_list.size() > REQUEST_LIST_MAX)
         {
             return false;
         }
-    }
-    else if (left >= 11 && strncmp(ptr, "/accountid/", 11) == 0)
-    {
-        size_t accountIDLength = 0;
-        ptr += 11;
-        left -= 11;
-        while (end != ptr+accountIDLength)
+
+        boost::shared_ptr<ListRequest> list(new ListRequest);
+        list->m_route = &route_;
+        list->m_ids = parameters_.m_list;
+        list->m_cached.resize(list->m_ids.size());
+        std::vector<uint32> missing;
+        for (size_t i = 0; i < list->m_ids.size(); i++)
         {
-            if (*(ptr+accountIDLength) == '/')
+            if (route_.m_cache.m_ttl == 0 || !EntityCache::GetInstance().Find(route_.m_operation, list->m_ids[i], list->m_cached[i]))
             {
-                break;
-            }
-            if (*(ptr+accountIDLength) == ' ' && *(ptr+accountIDLength+1) == 'H' && *(ptr+accountIDLength+2) == 'T' && *(ptr+accountIDLength+3) == 'T' && *(ptr+accountIDLength+4) == 'P')
-            {
-                return false;
-                break;
+                missing.push_back(list->m_ids[i]);
             }
-            accountIDLength++;
         }
-        uint32 accountID = 0;
-        try
-        {
-            accountID = boost::lexical_cast<uint32>(ptr, accountIDLength);
-        }
-        catch(boost::bad_lexical_cast)
-        { 
-            return false; 
-        }
-
-        ptr += accountIDLength;
-        left -= accountIDLength;
+        std::sort(missing.begin(), missing.end());
+        missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
 
-        if (left >= 12 && strncmp(ptr, "/recentGames", 12) == 0)
+        std::string response;
+        if (missing.empty() && Request::MergeLists(*list, response))
         {
-            RequestNumeric("playerStatsService", "getRecentGames", accountID, connection_);
+            connection_->SendAndRelease(response.c_str(), response.size());
             return true;
         }
-        else if (left >= 14 && strncmp(ptr, "/allPublicData", 14) == 0)
+        else if (missing.empty())
         {
-            RequestNumeric("summonerService", "getAllPublicSummonerDataByAccount", accountID, connection_);
-            return true;
-        }
-        else if (left >= 6 && strncmp(ptr, "/stats", 6) == 0)
+            // No envelope for the operation yet, the ids are asked again.
+            missing = list->m_ids;
+            std::sort(missing.begin(), missing.end());
+            missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+            list->m_cached.assign(list->m_ids.size(), std::string());
+        }
+
+        // The missing ids go to the workers in parts of the upstream size, in parallel.
+        list->m_parts.resize((missing.size()+REQUEST_LIST_PART-1)/REQUEST_LIST_PART);
+        list->m_partIds.resize(list->m_parts.size());
+        connection_->SplitList(list);
+        if (missing.size() < REQUEST_LIST_PART && ListBatcher::GetInstance().IsEnabled())
         {
-            RequestNumeric("playerStatsService", "retrievePlayerStatsByAccountId", accountID, connection_);
+            // A short list waits a moment for the ids other connections ask for the same route.
+            connection_->AddListPart(0);
+            ListBatcher::GetInstance().Add(route_, missing, list, 0, connection_);
             return true;
         }
-        else if (left >= 6 && strncmp(ptr, "/topPlayed", 6) == 0)
+        for (uint32 i = 0; i < list->m_parts.size(); i++)
         {
-            std::vector<RequestThing> list;
-            list.push_back(RequestThing(RequestType::Numeric_Request, (void*)accountID));
-            list.push_back(RequestThing(RequestType::String_Request, "CLASSIC"));
-            RequestGeneric("playerStatsService", "retrieveTopPlayedChampions", list, connection_);
-            return true;
+            std::vector<uint32>& part = list->m_partIds[i];
+            part.assign(missing.begin()+i*REQUEST_LIST_PART, missing.begin()+std::min<size_t>((i+1)*REQUEST_LIST_PART, missing.size()));
+            connection_->AddListPart(i);
+            Request::RequestList(route_, route_.m_destination, route_.m_operation, part, connection_);
         }
-        else if (left >= 13 && strncmp(ptr, "/rankedStats/", 13) == 0)
-        {
-            uint32 season = 0;
-            try
-            {
-                season = boost::lexical_cast<uint32>(ptr+13, 1);
-            }
-            catch(boost::bad_lexical_cast)
-            { 
-                return false; 
-            }
-
-            std::vector<RequestThing> list;
-            list.push_back(RequestThing(RequestType::Numeric_Request, (void*)accountID));
-            list.push_back(RequestThing(RequestType::String_Request, "CLASSIC"));
-            list.push_back(RequestThing(RequestType::Numeric_Request, (void*)season));
+        return true;
+    }
 
-            RequestGeneric("playerStatsService", "getAggregatedStats", list, connection_);
-            return true;
-        }
+    bool EncodeTopPlayed (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
+    {
+        std::vector<RequestThing> list;
+        list.push_back(RequestThing(RequestType::Numeric_Request, (void*)parameters_.m_numbers[0]));
+        list.push_back(RequestThing(RequestType::String_Request, "CLASSIC"));
+        Request::RequestGeneric(route_, route_.m_destination, route_.m_operation, list, connection_);
+        return true;
     }
-    else if (left >= 12 && strncmp(ptr, "/summonerid/", 12) == 0)
+
+    bool EncodeRankedStats (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
     {
-        size_t summonerIDLength = 0;
-        ptr += 12;
-        left -= 12;
-        while (end != ptr+summonerIDLength)
-        {
-            if (*(ptr+summonerIDLength) == '/')
-            {
-                break;
-            }
-            if (*(ptr+summonerIDLength) == ' ' && *(ptr+summonerIDLength+1) == 'H' && *(ptr+summonerIDLength+2) == 'T' && *(ptr+summonerIDLength+3) == 'T' && *(ptr+summonerIDLength+4) == 'P')
-            {
-                return false;
-                break;
-            }
-            summonerIDLength++;
-        }
+        std::vector<RequestThing> list;
+        list.push_back(RequestThing(RequestType::Numeric_Request, (void*)parameters_.m_numbers[0]));
+        list.push_back(RequestThing(RequestType::String_Request, "CLASSIC"));
+        list.push_back(RequestThing(RequestType::Numeric_Request, (void*)parameters_.m_numbers[1]));
+        Request::RequestGeneric(route_, route_.m_destination, route_.m_operation, list, connection_);
+        return true;
+    }
 
-        uint32 summonerID = 0;
-        try
-        {
-            summonerID = boost::lexical_cast<uint32>(ptr, summonerIDLength);
-        }
-        catch(boost::bad_lexical_cast)
-        { 
-            return false; 
-        }
-        
-        ptr += summonerIDLength;
-        left -= summonerIDLength;
+    bool EncodeHonor (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
+    {
+        std::string jsonString("{\"commandName\":\"TOTALS\",\"summonerId\":");
+        jsonString += boost::lexical_cast<std::string>(parameters_.m_numbers[0]);
+        jsonString += "}";
 
-        if (left >= 8 && strncmp(ptr, "/leagues", 8) == 0)
-        {
-            RequestNumeric("leaguesServiceProxy", "getAllLeaguesForPlayer", summonerID, connection_);
-            return true;
-        }
-        else if (left >= 6 && strncmp(ptr, "/honor", 6) == 0)
-        {
-            std::string jsonString("{\"commandName\":\"TOTALS\",\"summonerId\":");
-            jsonString += boost::lexical_cast<std::string>(summonerID);
-            jsonString += "}";
+        Request::RequestString(route_, route_.m_destination, route_.m_operation, jsonString, connection_);
+        return true;
+    }
 
-            RequestString("clientFacadeService", "callKudos", jsonString, connection_);
-            return true;
-        }
-        else if (left >= 6 && strncmp(ptr, "/runes", 6) == 0)
-        {
-            RequestNumeric("spellBookService", "getSpellBook", summonerID, connection_);
-            return true;
-        }
-        else if (left >= 10 && strncmp(ptr, "/masteries", 10) == 0)
-        {
-            RequestNumeric("masteryBookService", "getMasteryBook", summonerID, connection_);
-            return true;
-        }
+    // /numeric/{number}/{destination}/{operation}, the service is taken from the path.
+    bool EncodeAnyNumeric (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
+    {
+        Request::RequestNumeric(route_, parameters_.m_strings[1].c_str(), parameters_.m_strings[2].c_str(), parameters_.m_numbers[0], connection_);
+        return true;
     }
-    else if (left >= 6 && strncmp(ptr, "/list/", 6) == 0)
+
+    bool ServerStatus (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
     {
-        std::vector<uint32> list;
-        size_t summonerIDLength = 0;
-        ptr += 6;
-        left -= 6;
-        while (summonerIDLength++ <= left)
-        {
-            if (*(ptr+summonerIDLength) == ';')
-            {
-                try
-                {
-                    list.push_back(boost::lexical_cast<uint32>(ptr, summonerIDLength));
-                }
-                catch(boost::bad_lexical_cast)
-                { 
-                    return false; 
-                }
+        std::string workersData = Workers::GetInstance().GetWorkersInformation();
+        std::string result("HTTP/1.1 200 OK\r\nContent-Length: ");
+        result.append(boost::lexical_cast<std::string>(workersData.size()));
+        result.append("\r\n"
+                     "Content-Type: application/json\r\n"
+                     "\r\n");
+        result.append(workersData);
+        connection_->SendAndRelease(result.c_str(), result.size());
+        return true;
+    }
 
-                ptr += summonerIDLength+1;
-                left -= summonerIDLength+1;
-                summonerIDLength = 0;
-            }
-            else if (*(ptr+summonerIDLength) == '/')
-            {
-                try
-                {
-                    list.push_back(boost::lexical_cast<uint32>(ptr, summonerIDLength));
-                }
-                catch(boost::bad_lexical_cast)
-                { 
-                    return false; 
-                }
+    bool ServerMetrics (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
+    {
+        std::string metrics;
+        Metrics::GetInstance().Write(metrics);
+        std::string result("HTTP/1.1 200 OK\r\nContent-Length: ");
+        result.append(boost::lexical_cast<std::string>(metrics.size()));
+        result.append("\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "\r\n");
+        result.append(metrics);
+        connection_->SendAndRelease(result.c_str(), result.size());
+        return true;
+    }
 
-                ptr += summonerIDLength;
-                left -= summonerIDLength;
-                break;
-            }
-            if (*(ptr+summonerIDLength) == ' ' && *(ptr+summonerIDLength+1) == 'H' && *(ptr+summonerIDLength+2) == 'T' && *(ptr+summonerIDLength+3) == 'T' && *(ptr+summonerIDLength+4) == 'P')
-            {
-                return false;
-                break;
-            }
-        }
+    const char worker_not_found[] = "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 67\r\n"
+        "Content-Type: application/json\r\n"
+        "\r\n"
+        "{\"success\":false, \"code\":503, \"data\":{\"error\":\"Worker not found.\"}}";
 
-        if (list.size() > 30)
-        {
-            return false;
-        }
-        if (left >= 6 && strncmp(ptr, "/icons", 6) == 0)
+    bool WorkerTest (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
+    {
+        char buffer[1024] = {RequestType::String_Request, 0};
+        size_t offset = 5;
+        bool joined = false;
+        Task* task = TaskHolder::GetInstance().CreateTask(route_, connection_, "", route_.m_cache, joined);
+        if (!task)
         {
-            RequestList("summonerService", "getSummonerIcons", list, connection_);
+            Metrics::GetInstance().Increment(Metrics::Counter_Unavailable);
+            connection_->SendAndRelease(Request::s_serviceUnavailable, strlen(Request::s_serviceUnavailable));
             return true;
         }
-        else if (left >= 6 && strncmp(ptr, "/names", 6) == 0)
+        uint32 taskID = task->GetTaskID();
+        *(uint*)&buffer[1] = taskID;
+        // Copies the destination
+        buffer[offset] = strlen(route_.m_destination);
+        memcpy(buffer+offset+1, route_.m_destination, buffer[offset]+1);
+        offset += buffer[offset]+2;
+        // Copies the operation
+        buffer[offset] = strlen(route_.m_operation);
+        memcpy(buffer+offset+1, route_.m_operation, buffer[offset]+1);
+        offset += buffer[offset]+2;
+        // Copies the string
+        buffer[offset] = strlen("Honux");
+        memcpy(buffer+offset+1, "Honux", buffer[offset]+1);
+        offset += buffer[offset]+1;
+
+        if (!Workers::GetInstance().SendToWorkerAtPosition(parameters_.m_numbers[0], buffer, offset))
         {
-            RequestList("summonerService", "getSummonerNames", list, connection_);
-            return true;
+            // The task already owns the response slot, it answers instead of timing out.
+            Task* task = TaskHolder::GetInstance().Find(taskID);
+            if (task)
+            {
+                boost::lock_guard<boost::mutex> lock(task->GetMutex(), boost::adopt_lock);
+                task->DetachConnection(connection_);
+            }
+            Metrics::GetInstance().Increment(Metrics::Counter_Unavailable);
+            std::string response(worker_not_found);
+            connection_->CompleteTask(taskID, response);
         }
+        return true;
     }
-    else if (left >= 7 && strncmp(ptr, "/server", 7) == 0)
+
+    bool WorkerRestart (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
     {
-        ptr += 7;
-        left -= 7;
-        if (left >= 7 && strncmp(ptr, "/status", 7) == 0)
+        char buffer[20] = {(char)RequestType::Force_Reconnect, 0};
+        if (!Workers::GetInstance().SendToWorkerAtPosition(parameters_.m_numbers[0], buffer, 20))
         {
-            std::string workersData = Workers::GetInstance().GetWorkersInformation();
-            std::string result("HTTP/1.1 200 OK\r\nContent-Length: ");
-            result.append(boost::lexical_cast<std::string>(workersData.size()));
-            result.append("\r\n"
-                         "Content-Type: application/json\r\n"
-                         "Connection: close\r\n"
-                         "\r\n");
-            result.append(workersData);
-            result.append("\r\n");
-            connection_->SendAndRelease(result.c_str(), result.size());
+            Metrics::GetInstance().Increment(Metrics::Counter_Unavailable);
+            connection_->SendAndRelease(worker_not_found, strlen(worker_not_found));
             return true;
         }
-        else if (left >= 7 && strncmp(ptr, "/worker", 7) == 0)
-        {
-            ptr += 8;
-            left -= 8;
-            size_t workerIDLength = 0;
-            while (true)
-            {
-                if (*(ptr+workerIDLength) >= '0' && *(ptr+workerIDLength) <= '9')
-                {
-                    ++workerIDLength;
-                }
-                else
-                {
-                    break;
-                }
-            }
-            uint32 position = 0;
-            try
-            {
-                position = boost::lexical_cast<uint32>(ptr, workerIDLength);
-            }
-            catch (boost::bad_lexical_cast)
-            { 
-                return false; 
-            }
-
-            Worker* worker = Workers::GetInstance().GetWorkerAtPosition(position);
-            ptr += workerIDLength;
 
-            if (worker)
-            {
-                if (left >= 5 && strncmp(ptr, "/test", 5) == 0)
-                {
-                    char buffer[1024] = {RequestType::String_Request, 0};
-                    size_t offset = 5;
-                    *(uint*)&buffer[1] = TaskHolder::GetInstance().CreateTask("summonerService", "getSummonerByName", connection_)->GetTaskID();
-                    // Copies the destination
-                    buffer[offset] = strlen("summonerService");
-                    memcpy(buffer+offset+1, "summonerService", buffer[offset]+1);
-                    offset += buffer[offset]+2;
-                    // Copies the operation
-                    buffer[offset] = strlen("getSummonerByName");
-                    memcpy(buffer+offset+1, "getSummonerByName", buffer[offset]+1);
-                    offset += buffer[offset]+2;
-                    // Copies the string
-                    buffer[offset] = strlen("Honux");
-                    memcpy(buffer+offset+1, "Honux", buffer[offset]+1);
-                    offset += buffer[offset]+1;
-
-                    worker->SendData(buffer, offset);
-                    return true;
-                }
-                else if (left >= 8 && strncmp(ptr, "/restart", 8) == 0)
-                {
-                    char buffer[20] = {(char)RequestType::Force_Reconnect, 0};
-                    worker->SendData(buffer, 20);
-                    const char success[] = "HTTP/1.1 200 OK\r\n"
-                    "Content-Length: 72\r\n"
-                    "Content-Type: application/json\r\n"
-                    "Connection: close\r\n"
-                    "\r\n"
-                    "{\"success\":true, \"code\":200, \"data\":{\"message\":\"Worker is restarting.\"}}\r\n";
-                    connection_->SendAndRelease(success, strlen(success));
-                    return true;
-                }
-                else if (left >= 5 && strncmp(ptr, "/kill", 5) == 0)
-                {
-                    char buffer[20] = {(char)RequestType::Kill, 0};
-                    worker->SendData(buffer, 20);
-                    const char success[] = "HTTP/1.1 200 OK\r\n"
-                    "Content-Length: 84\r\n"
-                    "Content-Type: application/json\r\n"
-                    "Connection: close\r\n"
-                    "\r\n"
-                    "{\"success\":true, \"code\":200, \"data\":{\"message\":\"Killed the worker. List updated.\"}}\r\n";
-                    connection_->SendAndRelease(success, strlen(success));
-
-                    Workers::GetInstance().UnsubscribeWorker(worker->GetUniqueID());
-                    return true;
-                }
-            }
-            else
-            {
-                const char service_unavailable[] = "HTTP/1.1 503 Service Unavailable\r\n"
-                    "Content-Length: 67\r\n"
-                    "Content-Type: application/json\r\n"
-                    "Connection: close\r\n"
-                    "\r\n"
-                    "{\"success\":false, \"code\":503, \"data\":{\"error\":\"Worker not found.\"}}\r\n";
-                connection_->SendAndRelease(service_unavailable, strlen(service_unavailable));
-                return true;
-            }
-        }
+        const char success[] = "HTTP/1.1 200 OK\r\n"
+        "Content-Length: 72\r\n"
+        "Content-Type: application/json\r\n"
+        "\r\n"
+        "{\"success\":true, \"code\":200, \"data\":{\"message\":\"Worker is restarting.\"}}";
+        connection_->SendAndRelease(success, strlen(success));
+        return true;
     }
-    else if (left >= 8 && strncmp(ptr, "/numeric", 8) == 0)
-    {
-        ptr += 9;
-        left -= 9;
 
-        // Get the number
-        size_t numberLength = 0;
-        while (end != ptr+numberLength)
+    bool WorkerKill (const Route& route_, const RouteParameters& parameters_, Connection* connection_)
+    {
+        char buffer[20] = {(char)RequestType::Kill, 0};
+        uint32 uid = Workers::GetInstance().SendToWorkerAtPosition(parameters_.m_numbers[0], buffer, 20);
+        if (!uid)
         {
-            if (*(ptr+numberLength) == '/')
-            {
-                break;
-            }
-            numberLength++;
+            Metrics::GetInstance().Increment(Metrics::Counter_Unavailable);
+            connection_->SendAndRelease(worker_not_found, strlen(worker_not_found));
+            return true;
         }
 
-        uint32 number = 0;
-        try
-        {
-            number = boost::lexical_cast<uint32>(ptr, numberLength);
-        }
-        catch(boost::bad_lexical_cast)
-        { 
-            return false; 
-        }
-        
-        ptr += numberLength+1;
-        left -= numberLength+1;
+        const char success[] = "HTTP/1.1 200 OK\r\n"
+        "Content-Length: 83\r\n"
+        "Content-Type: application/json\r\n"
+        "\r\n"
+        "{\"success\":true, \"code\":200, \"data\":{\"message\":\"Killed the worker. List updated.\"}}";
+        connection_->SendAndRelease(success, strlen(success));
 
-        // Destination
-        size_t destinationLength = 0;
-        while (end != ptr+destinationLength)
-        {
-            if (*(ptr+destinationLength) == '/')
-            {
-                break;
-            }
-            destinationLength++;
-        }
-        std::string destination(ptr, destinationLength);
-        ptr += destinationLength+1;
-        left -= destinationLength+1;
+        Workers::GetInstance().UnsubscribeWorker(uid);
+        return true;
+    }
 
-        boost::replace_all(destination, "%20", " ");
+    // Adding a route is adding a line here.
+    const Route s_routes[] =
+    {
+        // Pattern                                      Destination                 Operation                               Encoder                 Cache, stale (s) Hedge
+        { "/player/{string}",                           "summonerService",          "getSummonerByName",                    &EncodeString,          { 60, 0 },       true },
+        { "/player/{string}/inGame",                    "gameService",              "retrieveInProgressSpectatorGameInfo",  &EncodeString,          { 15, 0 },       true },
+        { "/accountid/{number}/recentGames",            "playerStatsService",       "getRecentGames",                       &EncodeNumeric,         { 60, 0 },       true },
+        { "/accountid/{number}/allPublicData",          "summonerService",          "getAllPublicSummonerDataByAccount",    &EncodeNumeric,         { 300, 0 },      true },
+        { "/accountid/{number}/stats",                  "playerStatsService",       "retrievePlayerStatsByAccountId",       &EncodeNumeric,         { 300, 1800 },   true },
+        { "/accountid/{number}/topPlayed",              "playerStatsService",       "retrieveTopPlayedChampions",           &EncodeTopPlayed,       { 300, 0 },      true },
+        { "/accountid/{number}/rankedStats/{number}",   "playerStatsService",       "getAggregatedStats",                   &EncodeRankedStats,     { 300, 0 },      true },
+        { "/summonerid/{number}/leagues",               "leaguesServiceProxy",      "getAllLeaguesForPlayer",               &EncodeNumeric,         { 300, 1800 },   true },
+        { "/summonerid/{number}/honor",                 "clientFacadeService",      "callKudos",                            &EncodeHonor,           { 300, 0 },      true },
+        { "/summonerid/{number}/runes",                 "spellBookService",         "getSpellBook",                         &EncodeNumeric,         { 600, 3600 },   true },
+        { "/summonerid/{number}/masteries",             "masteryBookService",       "getMasteryBook",                       &EncodeNumeric,         { 600, 3600 },   true },
+        { "/list/{list}/icons",                         "summonerService",          "getSummonerIcons",                     &EncodeList,            { 600, 0 },      true },
+        { "/list/{list}/names",                         "summonerService",          "getSummonerNames",                     &EncodeList,            { 600, 0 },      true },
+        { "/numeric/{number}/{string}/{string}",        "",                         "",                                     &EncodeAnyNumeric,      { 0, 0 },        false },
+        { "/server/status",                             "",                         "",                                     &ServerStatus,          { 0, 0 },        false },
+        { "/server/metrics",                            "",                         "",                                     &ServerMetrics,         { 0, 0 },        false },
+        { "/server/worker/{number}/test",               "summonerService",          "getSummonerByName",                    &WorkerTest,            { 0, 0 },        false },
+        { "/server/worker/{number}/restart",            "",                         "",                                     &WorkerRestart,         { 0, 0 },        false },
+        { "/server/worker/{number}/kill",               "",                         "",                                     &WorkerKill,            { 0, 0 },        false },
+    };
+
+    // Built before main(), a function-local static is not thread-safe on every compiler.
+    const RouteTable s_routeTable(s_routes, sizeof(s_routes)/sizeof(s_routes[0]));
+}
 
-        // Service
-        size_t operationLength = 0;
-        while (end != ptr+operationLength)
-        {
-            if (*(ptr+operationLength) == '/')
-            {
-                break;
-            }
-            if (*(ptr+operationLength) == ' ' && *(ptr+operationLength+1) == 'H' && *(ptr+operationLength+2) == 'T' && *(ptr+operationLength+3) == 'T' && *(ptr+operationLength+4) == 'P')
-            {
-                break;
-            }
-            operationLength++;
-        }
-        std::string operation(ptr, operationLength);
-        ptr += operationLength+1;
-        left -= operationLength+1;
+void Request::RegisterRoutes ()
+{
+    // The route latencies and timeouts are kept by position in s_routes.
+    Metrics::GetInstance().SetRoutes(s_routes, sizeof(s_routes)/sizeof(s_routes[0]));
+    TaskTimeouts::GetInstance().SetRoutes(s_routes, sizeof(s_routes)/sizeof(s_routes[0]));
+}
 
-        boost::replace_all(operation, "%20", " ");
-        RequestNumeric(destination.c_str(), operation.c_str(), number, connection_);
-        return true;
+bool Request::ParseRequest (const HttpParser& request_, Connection* connection_)
+{
+    return ParsePath(request_.GetPath(), connection_);
+}
+
+bool Request::ParsePath (boost::string_ref path_, Connection* connection_)
+{
+    path_ = path_.substr(0, path_.find('?'));
+
+    RouteParameters parameters;
+    const Route* route = s_routeTable.Match(path_, parameters);
+    if (!route)
+    {
+        return false;
     }
-    return false;
+
+    connection_->SetRequestRoute(route);
+    return route->m_handler(*route, parameters, connection_);
 }
 
-void Request::RequestString (const char* destination_, const char* operation_, std::string& string_, Connection* connection_)
+void Request::RequestString (const Route& route_, const char* destination_, const char* operation_, std::string& string_, Connection* connection_)
 {
     char buffer[1024] = {RequestType::String_Request, 0};
     size_t offset = 5;
-    *(uint*)&buffer[1] = TaskHolder::GetInstance().CreateTask(destination_, operation_, connection_)->GetTaskID();
     // Copies the destination
     buffer[offset] = strlen(destination_);
     memcpy(buffer+offset+1, destination_, buffer[offset]+1);
@@ -445,14 +352,13 @@ void Request::RequestString (const char* destination_, const char* operation_, s
     memcpy(buffer+offset+1, string_.c_str(), buffer[offset]+1);
     offset += buffer[offset]+1;
 
-    Workers::GetInstance().GetAvaiableWorker()->SendData(buffer, offset);
+    _Dispatch(route_, buffer, offset, connection_);
 }
 
-void Request::RequestNumeric (const char* destination_, const char* operation_, uint32 number_, Connection* connection_)
+void Request::RequestNumeric (const Route& route_, const char* destination_, const char* operation_, uint32 number_, Connection* connection_)
 {
     char buffer[1024] = {RequestType::Numeric_Request, 0};
     size_t offset = 5;
-    *(uint*)&buffer[1] = TaskHolder::GetInstance().CreateTask(destination_, operation_, connection_)->GetTaskID();
     // Copies the destination
     buffer[offset] = strlen(destination_);
     memcpy(buffer+offset+1, destination_, buffer[offset]+1);
@@ -465,39 +371,158 @@ void Request::RequestNumeric (const char* destination_, const char* operation_,
     *(uint32*)&buffer[offset] = number_;
     offset += 4;
 
-    Workers::GetInstance().GetAvaiableWorker()->SendData(buffer, offset);
+    _Dispatch(route_, buffer, offset, connection_);
 }
 
-void Request::RequestList (const char* destination_, const char* operation_, std::vector<uint32>& list_, Connection* connection_)
+bool Request::MergeLists (ListRequest& list_, std::string& response_)
 {
-    char buffer[1024] = {RequestType::List_Request, 0};
+    const char* operation = list_.m_route->m_operation;
+    std::string prefix;
+    std::string suffix;
+    boost::unordered_map<uint32, std::string> entities;
+    bool isValid = true;
+    for (size_t i = 0; isValid && i < list_.m_parts.size(); i++)
+    {
+        std::string& part = list_.m_parts[i];
+        size_t bodyStart = part.find("\r\n\r\n");
+        if (part.compare(0, 12, "HTTP/1.1 200") != 0 || bodyStart == std::string::npos)
+        {
+            // The first part that failed answers for the whole list.
+            response_.swap(part);
+            return false;
+        }
+
+        rapidjson::Document document;
+        document.Parse<0>(part.c_str()+bodyStart+4);
+        if (document.HasParseError() || !document.IsObject() || !document.HasMember("data") || !document["data"].IsObject() ||
+            !document["data"].HasMember("body") || !document["data"]["body"].IsArray() ||
+            document["data"]["body"].Size() != list_.m_partIds[i].size())
+        {
+            isValid = false;
+            break;
+        }
+
+        // Writes the elements in a single array and cuts it, a value alone cannot be written.
+        rapidjson::Value& body = document["data"]["body"];
+        std::vector<size_t> ends;
+        rapidjson::StringBuffer elements;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(elements);
+        writer.StartArray();
+        for (rapidjson::SizeType j = 0; j < body.Size(); j++)
+        {
+            body[j].Accept(writer);
+            ends.push_back(elements.Size());
+        }
+        writer.EndArray(body.Size());
+        const char* text = elements.GetString();
+        // The elements come in the order of the ids asked for.
+        for (size_t j = 0, start = 1; j < ends.size(); start = ends[j++]+1)
+        {
+            entities[list_.m_partIds[i][j]].assign(text+start, ends[j]-start);
+        }
+
+        // The rest of the first response is kept around the elements of any list of the operation.
+        if (i == 0)
+        {
+            body.SetString("@entities@");
+            rapidjson::StringBuffer envelope;
+            rapidjson::Writer<rapidjson::StringBuffer> envelopeWriter(envelope);
+            document.Accept(envelopeWriter);
+            std::string text(envelope.GetString(), envelope.Size());
+            size_t marker = text.find("\"@entities@\"");
+            if (marker == std::string::npos)
+            {
+                isValid = false;
+                break;
+            }
+            prefix = text.substr(0, marker);
+            suffix = text.substr(marker+12);
+            EntityCache::GetInstance().StoreEnvelope(operation, prefix, suffix);
+        }
+    }
+
+    if (!isValid || (list_.m_parts.empty() && !EntityCache::GetInstance().FindEnvelope(operation, prefix, suffix)))
+    {
+        if (!list_.m_parts.empty())
+        {
+            response_ = s_badGateway;
+        }
+        return false;
+    }
+
+    for (boost::unordered_map<uint32, std::string>::iterator it = entities.begin(); it != entities.end(); it++)
+    {
+        EntityCache::GetInstance().Store(operation, (*it).first, (*it).second, list_.m_route->m_cache.m_ttl);
+    }
+
+    std::string body = prefix;
+    body.push_back('[');
+    for (size_t i = 0; i < list_.m_ids.size(); i++)
+    {
+        if (i)
+        {
+            body.push_back(',');
+        }
+        if (list_.m_cached[i].empty())
+        {
+            boost::unordered_map<uint32, std::string>::iterator it = entities.find(list_.m_ids[i]);
+            if (it == entities.end())
+            {
+                response_ = s_badGateway;
+                return false;
+            }
+            body.append((*it).second);
+        }
+        else
+        {
+            body.append(list_.m_cached[i]);
+        }
+    }
+    body.push_back(']');
+    body.append(suffix);
+
+    response_ = "HTTP/1.1 200 OK\r\nContent-Length: ";
+    response_.append(boost::lexical_cast<std::string>(body.size()));
+    response_.append("\r\nContent-Type: application/json; charset=UTF-8\r\n\r\n");
+    response_.append(body);
+    return true;
+}
+
+size_t Request::WriteListMessage (const char* destination_, const char* operation_, const std::vector<uint32>& list_, char* message_)
+{
+    message_[0] = RequestType::List_Request;
+    memset(message_+1, 0, 4);
     size_t offset = 5;
-    *(uint*)&buffer[1] = TaskHolder::GetInstance().CreateTask(destination_, operation_, connection_)->GetTaskID();
     // Copies the destination
-    buffer[offset] = strlen(destination_);
-    memcpy(buffer+offset+1, destination_, buffer[offset]+1);
-    offset += buffer[offset]+2;
+    message_[offset] = strlen(destination_);
+    memcpy(message_+offset+1, destination_, message_[offset]+1);
+    offset += message_[offset]+2;
     // Copies the operation
-    buffer[offset] = strlen(operation_);
-    memcpy(buffer+offset+1, operation_, buffer[offset]+1);
-    offset += buffer[offset]+2;
+    message_[offset] = strlen(operation_);
+    memcpy(message_+offset+1, operation_, message_[offset]+1);
+    offset += message_[offset]+2;
     // Copies the list size
-    buffer[offset++] = list_.size();
+    message_[offset++] = list_.size();
     // Copies the list elements
     for (std::vector<uint32>::const_iterator it = list_.begin(); it != list_.end(); it++)
     {
-        *(uint32*)&buffer[offset] = *it;
+        *(uint32*)&message_[offset] = *it;
         offset += 4;
     }
+    return offset;
+}
 
-    Workers::GetInstance().GetAvaiableWorker()->SendData(buffer, offset);
+void Request::RequestList (const Route& route_, const char* destination_, const char* operation_, std::vector<uint32>& list_, Connection* connection_)
+{
+    char buffer[1024];
+    size_t offset = WriteListMessage(destination_, operation_, list_, buffer);
+    _Dispatch(route_, buffer, offset, connection_);
 }
 
-void Request::RequestGeneric (const char* destination_, const char* operation_, std::vector<RequestThing>& list_, Connection* connection_)
+void Request::RequestGeneric (const Route& route_, const char* destination_, const char* operation_, std::vector<RequestThing>& list_, Connection* connection_)
 {
     char buffer[1024] = {RequestType::Generic_Request, 0};
     size_t offset = 5;
-    *(uint*)&buffer[1] = TaskHolder::GetInstance().CreateTask(destination_, operation_, connection_)->GetTaskID();
     // Copies the destination
     buffer[offset] = strlen(destination_);
     memcpy(buffer+offset+1, destination_, buffer[offset]+1);
@@ -526,5 +551,65 @@ void Request::RequestGeneric (const char* destination_, const char* operation_,
         }
     }
 
-    Workers::GetInstance().GetAvaiableWorker()->SendData(buffer, offset);
-}
\ No newline at end of file
+    _Dispatch(route_, buffer, offset, connection_);
+}
+
+void Request::_Dispatch (const Route& route_, char* message_, size_t messageLength_, Connection* connection_)
+{
+    // The message without its task id identifies the request.
+    std::string key(message_, 1);
+    key.append(message_+5, messageLength_-5);
+
+    if (route_.m_cache.m_ttl)
+    {
+        std::string response;
+        bool refresh = false;
+        if (ResponseCache::GetInstance().Find(key, connection_->AcceptsGzip(), response, refresh) != ResponseCache::Miss)
+        {
+            connection_->SendAndRelease(response.c_str(), response.size());
+            if (refresh)
+            {
+                // Stale response, a task nobody waits for refreshes it in the background.
+                Task* task = TaskHolder::GetInstance().CreateRefreshTask(route_, connection_, key, route_.m_cache);
+                if (task)
+                {
+                    *(uint32*)&message_[1] = task->GetTaskID();
+                    Workers::GetInstance().SendToAvailableWorker(connection_->GetShard(), message_, messageLength_);
+                }
+            }
+            return;
+        }
+    }
+
+    bool joined = false;
+    Task* task = TaskHolder::GetInstance().CreateTask(route_, connection_, key, route_.m_cache, joined);
+    if (!task)
+    {
+        Metrics::GetInstance().Increment(Metrics::Counter_Unavailable);
+        connection_->SendAndRelease(Request::s_serviceUnavailable, strlen(Request::s_serviceUnavailable));
+        return;
+    }
+    if (joined)
+    {
+        // The same request is already running, its response answers this one too.
+        return;
+    }
+
+    uint32 taskID = task->GetTaskID();
+    *(uint32*)&message_[1] = taskID;
+    uint32 workerUID = Workers::GetInstance().SendToAvailableWorker(connection_->GetShard(), message_, messageLength_);
+    if (!workerUID)
+    {
+        // No worker took it, the waiters are answered now instead of at the timeout.
+        task = TaskHolder::GetInstance().Find(taskID);
+        if (task)
+        {
+            boost::lock_guard<boost::mutex> lock(task->GetMutex(), boost::adopt_lock);
+            std::string response(s_serviceUnavailable);
+            task->Fail(response);
+        }
+        Metrics::GetInstance().Increment(Metrics::Counter_Unavailable);
+        return;
+    }
+    Hedger::GetInstance().Schedule(route_, connection_->GetShard(), taskID, workerUID, message_, messageLength_);
+}
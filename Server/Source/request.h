@@ -5,9 +5,30 @@
 #include "types.h"
 #include <string>
 #include <vector>
+#include <boost/utility/string_ref.hpp>
+
+// Ids the upstream takes in a single list call, the ids to ask for are sent in parts of this size.
+#define REQUEST_LIST_PART               30
 
 class Task;
 class Connection;
+class HttpParser;
+struct Route;
+
+///
+/// A list request answered from the EntityCache and from parts sent to the workers.
+///
+struct ListRequest
+{
+    const Route* m_route;
+    std::vector<uint32> m_ids;
+    // Entities found in the cache, by position in m_ids. Empty for the ids sent to the workers.
+    std::vector<std::string> m_cached;
+    // Responses of the parts, and the ids each part asked for, in order. A batched part asks for
+    // the ids of other requests too.
+    std::vector<std::string> m_parts;
+    std::vector<std::vector<uint32>> m_partIds;
+};
 
 struct RequestThing
 {
@@ -22,15 +43,47 @@ struct RequestThing
 class Request
 {
 public:
-    static bool ParseRequest (char* data_, size_t dataLength_, Connection* connection_);
+    // The error responses shared by the connections, the request handlers and the tasks.
+    static const char s_badRequest[];
+    // No worker is logged in, or every task slot of the shard is taken.
+    static const char s_serviceUnavailable[];
+    static const char s_requestTimeout[];
+    // A worker response could not be merged.
+    static const char s_badGateway[];
+    static const char s_versionNotSupported[];
+
+    // Hands the routes to Metrics and TaskTimeouts, once the Config is loaded and before the I/O
+    // threads start.
+    static void RegisterRoutes ();
+
+    static bool ParseRequest (const HttpParser& request_, Connection* connection_);
+
+    // Same as ParseRequest for a bare request target, the query string is ignored.
+    static bool ParsePath (boost::string_ref path_, Connection* connection_);
+
+    static void RequestString (const Route& route_, const char* destination_, const char* operation_, std::string& string_, Connection* connection_);
+
+    static void RequestNumeric (const Route& route_, const char* destination_, const char* operation_, uint32 number_, Connection* connection_);
+
+    // Writes the worker message of a list request into message_, with a task id of 0.
+    // @return The length of the message.
+    static size_t WriteListMessage (const char* destination_, const char* operation_, const std::vector<uint32>& list_, char* message_);
 
-    static void RequestString (const char* destination_, const char* operation_, std::string& string_, Connection* connection_);
+    static void RequestList (const Route& route_, const char* destination_, const char* operation_, std::vector<uint32>& list_, Connection* connection_);
 
-    static void RequestNumeric (const char* destination_, const char* operation_, uint32 number_, Connection* connection_);
+    ///
+    /// Builds the response of a list request from its cached entities and the "data.body" arrays
+    /// of its parts, in the order of the ids. The entities of the parts are cached on the way.
+    /// @return false if a part failed, response_ is then the failed part or a 502.
+    ///
+    static bool MergeLists (ListRequest& list_, std::string& response_);
 
-    static void RequestList (const char* destination_, const char* operation_, std::vector<uint32>& list_, Connection* connection_);
+    static void RequestGeneric (const Route& route_, const char* destination_, const char* operation_, std::vector<RequestThing>& list_, Connection* connection_);
 
-    static void RequestGeneric (const char* destination_, const char* operation_, std::vector<RequestThing>& list_, Connection* connection_);
+private:
+    // Answers from the ResponseCache when the route allows it, otherwise creates the task and sends
+    // the message to a worker. The task id is written into message_.
+    static void _Dispatch (const Route& route_, char* message_, size_t messageLength_, Connection* connection_);
 };
 
 #endif
\ No newline at end of file
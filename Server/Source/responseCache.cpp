@@ -0,0 +1,141 @@
+#include "responseCache.h"
+#include "contentEncoding.h"
+#include <boost/lexical_cast.hpp>
+
+#define RESPONSE_CACHE_REFRESH_RETRY    5
+
+ResponseCache::ResponseCache ()
+{
+}
+
+ResponseCache::Result ResponseCache::Find (const std::string& key_, bool acceptsGzip_, std::string& response_, bool& refresh_)
+{
+    refresh_ = false;
+    uint32 stripe = m_entries.GetStripe(key_);
+    boost::posix_time::ptime stored;
+    bool isDecoded = false;
+    Result result = _Find(stripe, key_, acceptsGzip_, response_, stored, isDecoded, refresh_);
+    if (result == Miss)
+    {
+        // Falls back to the disk, the entry comes back in memory for the next requests.
+        ResponseStore::Record record;
+        if (!m_entries.IsEnabled() || !ResponseStore::GetInstance().Find(key_, record))
+        {
+            return Miss;
+        }
+        {
+            boost::lock_guard<boost::mutex> lock(m_entries.GetMutex(stripe));
+            if (!m_entries.Find(stripe, key_))
+            {
+                _Insert(stripe, key_, record);
+            }
+        }
+        result = _Find(stripe, key_, acceptsGzip_, response_, stored, isDecoded, refresh_);
+        if (result == Miss)
+        {
+            return Miss;
+        }
+    }
+
+    if (!acceptsGzip_ && !isDecoded)
+    {
+        // Decoded once outside the lock, then kept next to the gzip response (Vary: Accept-Encoding).
+        std::string decoded;
+        if (ContentEncoding::Inflate(response_, decoded))
+        {
+            response_.swap(decoded);
+            boost::lock_guard<boost::mutex> lock(m_entries.GetMutex(stripe));
+            Entry* entry = m_entries.Find(stripe, key_);
+            if (entry && entry->m_stored == stored)
+            {
+                entry->m_decoded = response_;
+            }
+        }
+    }
+
+    size_t statusEnd = response_.find("\r\n");
+    if (statusEnd != std::string::npos)
+    {
+        boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+        response_.insert(statusEnd+2, "Age: "+boost::lexical_cast<std::string>((now-stored).total_seconds())+"\r\n");
+    }
+    return result;
+}
+
+void ResponseCache::Store (const std::string& key_, const std::string& response_, const CachePolicy& policy_)
+{
+    if (policy_.m_ttl == 0 || !m_entries.IsEnabled())
+    {
+        return;
+    }
+
+    ResponseStore::Record record;
+    record.m_response = response_;
+    record.m_stored = boost::posix_time::microsec_clock::universal_time();
+    record.m_freshUntil = record.m_stored+boost::posix_time::seconds(policy_.m_ttl);
+    record.m_staleUntil = record.m_freshUntil+boost::posix_time::seconds(policy_.m_staleTTL);
+
+    {
+        uint32 stripe = m_entries.GetStripe(key_);
+        boost::lock_guard<boost::mutex> lock(m_entries.GetMutex(stripe));
+        _Insert(stripe, key_, record);
+    }
+    ResponseStore::GetInstance().Store(key_, record);
+}
+
+void ResponseCache::SetCapacity (uint32 entries_)
+{
+    m_entries.SetCapacity(entries_);
+}
+
+void ResponseCache::_Insert (uint32 stripe_, const std::string& key_, const ResponseStore::Record& record_)
+{
+    Entry& entry = m_entries.Insert(stripe_, key_);
+    entry.m_response = record_.m_response;
+    entry.m_decoded.clear();
+    entry.m_stored = record_.m_stored;
+    entry.m_freshUntil = record_.m_freshUntil;
+    entry.m_staleUntil = record_.m_staleUntil;
+    entry.m_refreshUntil = record_.m_stored;
+}
+
+ResponseCache::Result ResponseCache::_Find (uint32 stripe_, const std::string& key_, bool acceptsGzip_, std::string& response_, boost::posix_time::ptime& stored_, bool& isDecoded_, bool& refresh_)
+{
+    boost::lock_guard<boost::mutex> lock(m_entries.GetMutex(stripe_));
+    Entry* found = m_entries.Find(stripe_, key_);
+    if (!found)
+    {
+        return Miss;
+    }
+
+    Entry& entry = *found;
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    if (entry.m_staleUntil <= now)
+    {
+        m_entries.Erase(stripe_, key_);
+        return Miss;
+    }
+
+    Result result = Fresh;
+    if (entry.m_freshUntil <= now)
+    {
+        result = Stale;
+        // A single refresh at a time, another one is allowed if it did not make it.
+        if (entry.m_refreshUntil <= now)
+        {
+            entry.m_refreshUntil = now+boost::posix_time::seconds(RESPONSE_CACHE_REFRESH_RETRY);
+            refresh_ = true;
+        }
+    }
+
+    isDecoded_ = !acceptsGzip_ && !entry.m_decoded.empty();
+    response_ = isDecoded_ ? entry.m_decoded : entry.m_response;
+    stored_ = entry.m_stored;
+    return result;
+}
+
+ResponseCache& ResponseCache::GetInstance ()
+{
+    static ResponseCache instance;
+    return instance;
+}
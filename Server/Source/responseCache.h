@@ -0,0 +1,73 @@
+#ifndef _RESPONSECACHE_H_
+#define _RESPONSECACHE_H_
+
+#include "types.h"
+#include "responseStore.h"
+#include "stripedLru.h"
+#include <string>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/locks.hpp>
+
+#define RESPONSE_CACHE_STRIPES          16
+
+struct CachePolicy
+{
+    // Seconds a response is served as it is, 0 disables caching.
+    uint32 m_ttl;
+    // Seconds after that during which the old response is still served while a single refresh runs.
+    uint32 m_staleTTL;
+};
+
+///
+/// Completed worker responses, ready to be sent as they are.
+/// Keyed by the message sent to the worker without its task id, so two requests asking the same
+/// service for the same arguments share their entry.
+/// Stored responses are written through to the ResponseStore, which answers the memory misses.
+///
+class ResponseCache
+{
+public:
+    enum Result
+    {
+        Miss,
+        Fresh,
+        Stale
+    };
+
+    ///
+    /// Copies the cached response of key_ into response_, with an Age header.
+    /// @param[in] acceptsGzip_ false to get the response decoded, the decoded variant is kept as well.
+    /// @param[out] refresh_ true for the one caller that should refresh a stale entry.
+    ///
+    Result Find (const std::string& key_, bool acceptsGzip_, std::string& response_, bool& refresh_);
+
+    void Store (const std::string& key_, const std::string& response_, const CachePolicy& policy_);
+
+    // Bounds the number of entries, the least recently used ones are dropped first. Must be set
+    // before the I/O threads start, the cache is disabled until then.
+    void SetCapacity (uint32 entries_);
+
+    static ResponseCache& GetInstance ();
+
+private:
+    ResponseCache ();
+
+    struct Entry
+    {
+        std::string m_response;
+        // Identity encoded copy of m_response, made on the first request that cannot inflate.
+        std::string m_decoded;
+        boost::posix_time::ptime m_stored;
+        boost::posix_time::ptime m_freshUntil;
+        boost::posix_time::ptime m_staleUntil;
+        boost::posix_time::ptime m_refreshUntil;
+    };
+
+    Result _Find (uint32 stripe_, const std::string& key_, bool acceptsGzip_, std::string& response_, boost::posix_time::ptime& stored_, bool& isDecoded_, bool& refresh_);
+    // The stripe must be locked.
+    void _Insert (uint32 stripe_, const std::string& key_, const ResponseStore::Record& record_);
+
+    StripedLru<Entry, RESPONSE_CACHE_STRIPES> m_entries;
+};
+
+#endif
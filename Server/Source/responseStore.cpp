@@ -0,0 +1,512 @@
+#include "responseStore.h"
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+
+#define RESPONSE_STORE_MAGIC                0x31535252
+// Records waiting for the background thread, the newest ones are dropped past it.
+#define RESPONSE_STORE_MAX_PENDING          4096
+// Seconds between two flushes of the active segment.
+#define RESPONSE_STORE_FLUSH_INTERVAL       1
+// Seconds between two compactions.
+#define RESPONSE_STORE_COMPACTION_INTERVAL  60
+// A full segment is compacted once less than this percentage of it is live.
+#define RESPONSE_STORE_COMPACTION_LIVE      50
+// Records copied by the compaction between two updates of the index.
+#define RESPONSE_STORE_COMPACTION_BATCH     256
+
+namespace
+{
+    const boost::posix_time::ptime s_epoch(boost::gregorian::date(1970, 1, 1));
+
+    inline uint64 ToSeconds (const boost::posix_time::ptime& time_)
+    {
+        return (uint64)(time_-s_epoch).total_seconds();
+    }
+
+    inline boost::posix_time::ptime FromSeconds (uint64 seconds_)
+    {
+        return s_epoch+boost::posix_time::seconds((long)seconds_);
+    }
+
+    inline uint32 RecordLength (uint32 keyLength_, uint32 responseLength_)
+    {
+        return (sizeof(uint32)*4+sizeof(uint64)*3+keyLength_+responseLength_+7) & ~7;
+    }
+
+    uint32 Checksum (const char* record_, uint32 keyLength_, uint32 responseLength_)
+    {
+        boost::crc_32_type crc;
+        crc.process_bytes(record_+sizeof(uint32)*2, RecordLength(keyLength_, responseLength_)-sizeof(uint32)*2);
+        return crc.checksum();
+    }
+}
+
+ResponseStore::ResponseStore ()
+    :m_segmentSize(0),
+    m_isOpen(false),
+    m_activeSegment(0),
+    m_nextSegment(0),
+    m_isClosing(false)
+{
+}
+
+ResponseStore::~ResponseStore ()
+{
+    Close();
+}
+
+bool ResponseStore::Open (const std::string& directory_, uint32 segmentSize_)
+{
+    m_directory = directory_;
+    m_segmentSize = segmentSize_;
+
+    std::map<uint32, std::string> files;
+    try
+    {
+        boost::filesystem::create_directories(m_directory);
+        for (boost::filesystem::directory_iterator it(m_directory); it != boost::filesystem::directory_iterator(); it++)
+        {
+            uint32 number = 0;
+            char extra = 0;
+            if (sscanf((*it).path().filename().string().c_str(), "segment_%08u.dat%c", &number, &extra) == 1)
+            {
+                files[number] = (*it).path().string();
+            }
+        }
+    }
+    catch (std::exception const& e)
+    {
+        printf("%s\n", e.what());
+        return false;
+    }
+
+    // Later records of a key replace the earlier ones, so the segments are loaded in order.
+    uint64 now = ToSeconds(boost::posix_time::second_clock::universal_time());
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    for (std::map<uint32, std::string>::iterator it = files.begin(); it != files.end(); it++)
+    {
+        if (_MapSegment((*it).first, (*it).second))
+        {
+            _LoadSegment((*it).first, now);
+        }
+        m_nextSegment = (*it).first+1;
+    }
+
+    if (m_segments.empty() && !_CreateSegment())
+    {
+        return false;
+    }
+    m_activeSegment = (*m_segments.rbegin()).first;
+
+    m_isOpen = true;
+    m_thread = boost::thread(boost::bind(&ResponseStore::_Run, this));
+    return true;
+}
+
+void ResponseStore::Close ()
+{
+    if (!m_isOpen)
+    {
+        return;
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(m_queueMutex);
+        m_isClosing = true;
+    }
+    m_queueCondition.notify_one();
+    m_thread.join();
+
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    m_isOpen = false;
+    for (std::map<uint32, Segment*>::iterator it = m_segments.begin(); it != m_segments.end(); it++)
+    {
+        (*it).second->m_region->flush(0, 0, false);
+        delete (*it).second->m_region;
+        delete (*it).second->m_file;
+        delete (*it).second;
+    }
+    m_segments.clear();
+    m_index.clear();
+}
+
+bool ResponseStore::Find (const std::string& key_, Record& record_)
+{
+    if (!m_isOpen)
+    {
+        return false;
+    }
+
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    boost::unordered_map<std::string, Location>::iterator it = m_index.find(key_);
+    if (it == m_index.end())
+    {
+        return false;
+    }
+
+    if ((*it).second.m_staleUntil <= ToSeconds(boost::posix_time::second_clock::universal_time()))
+    {
+        _Forget(it);
+        return false;
+    }
+
+    Segment* segment = m_segments[(*it).second.m_segment];
+    const char* data = (const char*)segment->m_region->get_address()+(*it).second.m_offset;
+    RecordHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (!(*it).second.m_isVerified)
+    {
+        if (Checksum(data, header.m_keyLength, header.m_responseLength) != header.m_checksum)
+        {
+            _Forget(it);
+            return false;
+        }
+        (*it).second.m_isVerified = true;
+    }
+    record_.m_response.assign(data+sizeof(header)+header.m_keyLength, header.m_responseLength);
+    record_.m_stored = FromSeconds(header.m_stored);
+    record_.m_freshUntil = FromSeconds(header.m_freshUntil);
+    record_.m_staleUntil = FromSeconds(header.m_staleUntil);
+    return true;
+}
+
+void ResponseStore::Store (const std::string& key_, const Record& record_)
+{
+    if (!m_isOpen)
+    {
+        return;
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(m_queueMutex);
+        if (m_pending.size() >= RESPONSE_STORE_MAX_PENDING)
+        {
+            return;
+        }
+        m_pending.push_back(Pending());
+        m_pending.back().m_key = key_;
+        m_pending.back().m_record = record_;
+    }
+    m_queueCondition.notify_one();
+}
+
+ResponseStore& ResponseStore::GetInstance ()
+{
+    static ResponseStore instance;
+    return instance;
+}
+
+void ResponseStore::_Run ()
+{
+    boost::posix_time::ptime nextCompaction = boost::posix_time::second_clock::universal_time()+boost::posix_time::seconds(RESPONSE_STORE_COMPACTION_INTERVAL);
+    for (;;)
+    {
+        std::deque<Pending> pending;
+        bool closing = false;
+        {
+            boost::unique_lock<boost::mutex> lock(m_queueMutex);
+            if (m_pending.empty() && !m_isClosing)
+            {
+                m_queueCondition.timed_wait(lock, boost::posix_time::seconds(RESPONSE_STORE_FLUSH_INTERVAL));
+            }
+            pending.swap(m_pending);
+            closing = m_isClosing;
+        }
+
+        // The records are written without the lock, only their index entries need it.
+        std::vector<Location> locations(pending.size());
+        for (size_t i = 0; i < pending.size(); i++)
+        {
+            const Record& record = pending[i].m_record;
+            RecordHeader header;
+            header.m_magic = RESPONSE_STORE_MAGIC;
+            header.m_checksum = 0;
+            header.m_keyLength = pending[i].m_key.size();
+            header.m_responseLength = record.m_response.size();
+            header.m_stored = ToSeconds(record.m_stored);
+            header.m_freshUntil = ToSeconds(record.m_freshUntil);
+            header.m_staleUntil = ToSeconds(record.m_staleUntil);
+
+            if (!_Write(pending[i].m_key, header, record.m_response.data(), locations[i]))
+            {
+                locations[i].m_length = 0;
+            }
+        }
+
+        if (!pending.empty())
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            for (size_t i = 0; i < pending.size(); i++)
+            {
+                if (locations[i].m_length)
+                {
+                    _Index(pending[i].m_key, locations[i]);
+                }
+            }
+            m_segments[m_activeSegment]->m_region->flush();
+        }
+
+        if (closing)
+        {
+            return;
+        }
+
+        if (boost::posix_time::second_clock::universal_time() >= nextCompaction)
+        {
+            _Compact();
+            nextCompaction = boost::posix_time::second_clock::universal_time()+boost::posix_time::seconds(RESPONSE_STORE_COMPACTION_INTERVAL);
+        }
+    }
+}
+
+bool ResponseStore::_MapSegment (uint32 number_, const std::string& path_)
+{
+    Segment* segment = new Segment();
+    segment->m_path = path_;
+    try
+    {
+        segment->m_file = new boost::interprocess::file_mapping(path_.c_str(), boost::interprocess::read_write);
+        segment->m_region = new boost::interprocess::mapped_region(*segment->m_file, boost::interprocess::read_write);
+    }
+    catch (std::exception const& e)
+    {
+        printf("%s: %s\n", path_.c_str(), e.what());
+        delete segment->m_file;
+        delete segment;
+        return false;
+    }
+    segment->m_size = segment->m_region->get_size();
+    m_segments[number_] = segment;
+    return true;
+}
+
+void ResponseStore::_LoadSegment (uint32 number_, uint64 now_)
+{
+    Segment* segment = m_segments[number_];
+    const char* data = (const char*)segment->m_region->get_address();
+
+    // Walks the record headers up to the first one that is not complete, the responses are
+    // only read by Find().
+    uint32 offset = 0;
+    while (offset+sizeof(RecordHeader) <= segment->m_size)
+    {
+        RecordHeader header;
+        memcpy(&header, data+offset, sizeof(header));
+        if (header.m_magic != RESPONSE_STORE_MAGIC || header.m_keyLength > segment->m_size || header.m_responseLength > segment->m_size)
+        {
+            break;
+        }
+        uint32 length = RecordLength(header.m_keyLength, header.m_responseLength);
+        if (offset+length > segment->m_size)
+        {
+            break;
+        }
+
+        std::string key(data+offset+sizeof(header), header.m_keyLength);
+        boost::unordered_map<std::string, Location>::iterator it = m_index.find(key);
+        if (it != m_index.end())
+        {
+            _Forget(it);
+        }
+        if (header.m_staleUntil > now_)
+        {
+            Location& location = m_index[key];
+            location.m_segment = number_;
+            location.m_offset = offset;
+            location.m_length = length;
+            location.m_staleUntil = header.m_staleUntil;
+            location.m_isVerified = false;
+            segment->m_liveBytes += length;
+        }
+        offset += length;
+    }
+    segment->m_end = offset;
+}
+
+bool ResponseStore::_CreateSegment ()
+{
+    char name[32];
+    sprintf(name, "segment_%08u.dat", m_nextSegment);
+    std::string path = (boost::filesystem::path(m_directory)/name).string();
+
+    {
+        std::filebuf file;
+        if (!file.open(path.c_str(), std::ios_base::in | std::ios_base::out | std::ios_base::trunc | std::ios_base::binary))
+        {
+            printf("Could not create %s\n", path.c_str());
+            return false;
+        }
+        file.pubseekoff(m_segmentSize-1, std::ios_base::beg);
+        file.sputc(0);
+    }
+
+    if (!_MapSegment(m_nextSegment, path))
+    {
+        return false;
+    }
+    m_activeSegment = m_nextSegment++;
+    return true;
+}
+
+void ResponseStore::_RemoveSegment (std::map<uint32, Segment*>::iterator it_)
+{
+    Segment* segment = (*it_).second;
+    m_segments.erase(it_);
+    delete segment->m_region;
+    delete segment->m_file;
+    boost::system::error_code error;
+    boost::filesystem::remove(segment->m_path, error);
+    delete segment;
+}
+
+bool ResponseStore::_Write (const std::string& key_, const RecordHeader& header_, const char* response_, Location& location_)
+{
+    uint32 length = RecordLength(header_.m_keyLength, header_.m_responseLength);
+    if (length > m_segmentSize)
+    {
+        return false;
+    }
+
+    Segment* segment = m_segments[m_activeSegment];
+    if (segment->m_end+length > segment->m_size)
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        if (!_CreateSegment())
+        {
+            return false;
+        }
+        segment = m_segments[m_activeSegment];
+    }
+
+    char* data = (char*)segment->m_region->get_address()+segment->m_end;
+    RecordHeader header = header_;
+    header.m_magic = 0;
+    memcpy(data, &header, sizeof(header));
+    memcpy(data+sizeof(header), key_.data(), header.m_keyLength);
+    memcpy(data+sizeof(header)+header.m_keyLength, response_, header.m_responseLength);
+    header.m_checksum = Checksum(data, header.m_keyLength, header.m_responseLength);
+    memcpy(data+sizeof(uint32), &header.m_checksum, sizeof(uint32));
+    // The magic goes last, a record is not seen before it is complete.
+    header.m_magic = RESPONSE_STORE_MAGIC;
+    memcpy(data, &header.m_magic, sizeof(uint32));
+
+    location_.m_segment = m_activeSegment;
+    location_.m_offset = segment->m_end;
+    location_.m_length = length;
+    location_.m_staleUntil = header.m_staleUntil;
+    location_.m_isVerified = true;
+    segment->m_end += length;
+    return true;
+}
+
+void ResponseStore::_Index (const std::string& key_, const Location& location_)
+{
+    boost::unordered_map<std::string, Location>::iterator it = m_index.find(key_);
+    if (it != m_index.end())
+    {
+        _Forget(it);
+    }
+    m_index[key_] = location_;
+    m_segments[location_.m_segment]->m_liveBytes += location_.m_length;
+}
+
+void ResponseStore::_Forget (boost::unordered_map<std::string, Location>::iterator it_)
+{
+    std::map<uint32, Segment*>::iterator segment = m_segments.find((*it_).second.m_segment);
+    if (segment != m_segments.end())
+    {
+        (*segment).second->m_liveBytes -= (*it_).second.m_length;
+    }
+    m_index.erase(it_);
+}
+
+void ResponseStore::_Compact ()
+{
+    // The live records of the emptiest segments, found in a single pass over the index.
+    std::vector<uint32> numbers;
+    std::vector<std::pair<std::string, Location>> records;
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        uint64 now = ToSeconds(boost::posix_time::second_clock::universal_time());
+        for (boost::unordered_map<std::string, Location>::iterator it = m_index.begin(); it != m_index.end();)
+        {
+            boost::unordered_map<std::string, Location>::iterator current = it++;
+            if ((*current).second.m_staleUntil <= now)
+            {
+                _Forget(current);
+            }
+        }
+
+        for (std::map<uint32, Segment*>::iterator it = m_segments.begin(); it != m_segments.end(); it++)
+        {
+            if ((*it).first != m_activeSegment && (uint64)(*it).second->m_liveBytes*100 < (uint64)(*it).second->m_size*RESPONSE_STORE_COMPACTION_LIVE)
+            {
+                numbers.push_back((*it).first);
+            }
+        }
+        if (numbers.empty())
+        {
+            return;
+        }
+
+        for (boost::unordered_map<std::string, Location>::iterator it = m_index.begin(); it != m_index.end(); it++)
+        {
+            if (std::find(numbers.begin(), numbers.end(), (*it).second.m_segment) != numbers.end())
+            {
+                records.push_back(*it);
+            }
+        }
+    }
+
+    // Copies them to the active segment without the lock, which is only taken to move the index
+    // entries of a batch. Find() may forget the expired ones meanwhile, their copies stay dead.
+    for (size_t first = 0; first < records.size(); first += RESPONSE_STORE_COMPACTION_BATCH)
+    {
+        size_t last = std::min<size_t>(first+RESPONSE_STORE_COMPACTION_BATCH, records.size());
+        std::vector<Location> copies(last-first);
+        for (size_t i = first; i < last; i++)
+        {
+            const Location& location = records[i].second;
+            const char* record = (const char*)m_segments[location.m_segment]->m_region->get_address()+location.m_offset;
+            RecordHeader header;
+            memcpy(&header, record, sizeof(header));
+            // A torn record must not get a valid checksum in its copy.
+            bool isValid = location.m_isVerified || Checksum(record, header.m_keyLength, header.m_responseLength) == header.m_checksum;
+            if (!isValid || !_Write(records[i].first, header, record+sizeof(header)+header.m_keyLength, copies[i-first]))
+            {
+                copies[i-first].m_length = 0;
+            }
+        }
+
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        for (size_t i = first; i < last; i++)
+        {
+            boost::unordered_map<std::string, Location>::iterator it = m_index.find(records[i].first);
+            if (it == m_index.end() || (*it).second.m_segment != records[i].second.m_segment || (*it).second.m_offset != records[i].second.m_offset)
+            {
+                continue;
+            }
+            if (copies[i-first].m_length)
+            {
+                _Index(records[i].first, copies[i-first]);
+            }
+            else
+            {
+                _Forget(it);
+            }
+        }
+    }
+
+    // The copies are on disk before the files they come from go away.
+    m_segments[m_activeSegment]->m_region->flush();
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    for (size_t i = 0; i < numbers.size(); i++)
+    {
+        _RemoveSegment(m_segments.find(numbers[i]));
+    }
+}
@@ -0,0 +1,133 @@
+#ifndef _RESPONSESTORE_H_
+#define _RESPONSESTORE_H_
+
+#include "types.h"
+#include <string>
+#include <deque>
+#include <map>
+#include <boost/unordered_map.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+///
+/// Cached responses kept on disk, so a restart does not send every hot key to the workers again.
+/// Records are appended to fixed size segment files mapped in memory. At startup the index is
+/// rebuilt from the record headers of the mapped segments, without reading the responses, whose
+/// checksum is verified by the first Find() of the record. A background thread appends the
+/// records and compacts the segments whose records mostly expired or were replaced.
+///
+class ResponseStore
+{
+public:
+    struct Record
+    {
+        std::string m_response;
+        boost::posix_time::ptime m_stored;
+        boost::posix_time::ptime m_freshUntil;
+        boost::posix_time::ptime m_staleUntil;
+    };
+
+    ///
+    /// Maps the segments found in directory_ and starts the background thread.
+    /// @param[in] segmentSize_ Size in bytes of the segment files created from now on.
+    /// @return false if the directory cannot be used, the store stays disabled then.
+    ///
+    bool Open (const std::string& directory_, uint32 segmentSize_);
+
+    // Writes the queued records and unmaps the segments.
+    void Close ();
+
+    // Copies the record of key_, false if there is none or it expired.
+    bool Find (const std::string& key_, Record& record_);
+
+    // Queues the record for the background thread, can be called from any thread.
+    void Store (const std::string& key_, const Record& record_);
+
+    static ResponseStore& GetInstance ();
+
+private:
+    ResponseStore ();
+    ~ResponseStore ();
+
+    struct RecordHeader
+    {
+        uint32 m_magic;
+        // CRC-32 of everything after this field, a torn write is dropped by the first Find() of the record.
+        uint32 m_checksum;
+        uint32 m_keyLength;
+        uint32 m_responseLength;
+        // Seconds since the epoch.
+        uint64 m_stored;
+        uint64 m_freshUntil;
+        uint64 m_staleUntil;
+    };
+
+    struct Segment
+    {
+        Segment ()
+         :m_file(NULL),
+         m_region(NULL),
+         m_size(0),
+         m_end(0),
+         m_liveBytes(0)
+        {};
+        std::string m_path;
+        boost::interprocess::file_mapping* m_file;
+        boost::interprocess::mapped_region* m_region;
+        uint32 m_size;
+        uint32 m_end;
+        // Bytes of the records the index still points to.
+        uint32 m_liveBytes;
+    };
+
+    struct Location
+    {
+        uint32 m_segment;
+        uint32 m_offset;
+        uint32 m_length;
+        uint64 m_staleUntil;
+        // The checksum of the record was checked, always true for the ones written since Open().
+        bool m_isVerified;
+    };
+
+    struct Pending
+    {
+        std::string m_key;
+        Record m_record;
+    };
+
+    void _Run ();
+    bool _MapSegment (uint32 number_, const std::string& path_);
+    void _LoadSegment (uint32 number_, uint64 now_);
+    bool _CreateSegment ();
+    void _RemoveSegment (std::map<uint32, Segment*>::iterator it_);
+    bool _Write (const std::string& key_, const RecordHeader& header_, const char* response_, Location& location_);
+    void _Index (const std::string& key_, const Location& location_);
+    void _Forget (boost::unordered_map<std::string, Location>::iterator it_);
+    void _Compact ();
+
+    std::string m_directory;
+    uint32 m_segmentSize;
+    bool m_isOpen;
+
+    // Guards the segments and the index. The background thread is the only one writing records
+    // and changing the segments, it reads them without the lock.
+    boost::mutex m_mutex;
+    std::map<uint32, Segment*> m_segments;
+    boost::unordered_map<std::string, Location> m_index;
+    uint32 m_activeSegment;
+    uint32 m_nextSegment;
+
+    boost::mutex m_queueMutex;
+    boost::condition_variable m_queueCondition;
+    std::deque<Pending> m_pending;
+    bool m_isClosing;
+    boost::thread m_thread;
+};
+
+#endif
@@ -0,0 +1,258 @@
+#include "routes.h"
+#include <cassert>
+#include <stdexcept>
+
+namespace
+{
+    // Cuts the next segment out of path_, "/player/Honux/inGame" gives "player" and leaves "/Honux/inGame".
+    boost::string_ref NextSegment (boost::string_ref& path_)
+    {
+        if (!path_.empty() && path_.front() == '/')
+        {
+            path_.remove_prefix(1);
+        }
+        size_t slash = path_.find('/');
+        boost::string_ref segment = path_.substr(0, slash);
+        path_ = (slash == boost::string_ref::npos) ? boost::string_ref() : path_.substr(slash);
+        return segment;
+    }
+
+    RouteParameterType GetParameterType (boost::string_ref segment_)
+    {
+        if (segment_ == "{number}")
+        {
+            return Route_Number;
+        }
+        else if (segment_ == "{string}")
+        {
+            return Route_String;
+        }
+        else if (segment_ == "{list}")
+        {
+            return Route_NumberList;
+        }
+        return Route_Literal;
+    }
+
+    inline int HexValue (char c_)
+    {
+        if (c_ >= '0' && c_ <= '9')
+        {
+            return c_-'0';
+        }
+        else if (c_ >= 'a' && c_ <= 'f')
+        {
+            return c_-'a'+10;
+        }
+        else if (c_ >= 'A' && c_ <= 'F')
+        {
+            return c_-'A'+10;
+        }
+        return -1;
+    }
+}
+
+RouteTable::RouteTable (const Route* routes_, size_t routeCount_)
+    :m_root(new Node())
+{
+    for (size_t i = 0; i < routeCount_; i++)
+    {
+        _Insert(&routes_[i]);
+    }
+}
+
+RouteTable::~RouteTable ()
+{
+    _Release(m_root);
+}
+
+const Route* RouteTable::Match (boost::string_ref path_, RouteParameters& parameters_) const
+{
+    const Node* node = m_root;
+    parameters_.m_count = 0;
+
+    while (!path_.empty() && path_ != "/")
+    {
+        boost::string_ref segment = NextSegment(path_);
+
+        const Node* next = nullptr;
+        for (std::vector<std::pair<std::string, Node*>>::const_iterator it = node->m_literals.begin(); it != node->m_literals.end(); it++)
+        {
+            if (segment == (*it).first)
+            {
+                next = (*it).second;
+                break;
+            }
+        }
+
+        if (!next && node->m_parameter)
+        {
+            next = node->m_parameter;
+            uint32 index = parameters_.m_count++;
+            switch (next->m_parameterType)
+            {
+            case Route_Number:
+                if (!ParseNumber(segment, parameters_.m_numbers[index]))
+                {
+                    return nullptr;
+                }
+                break;
+            case Route_String:
+                if (!DecodeString(segment, parameters_.m_strings[index]))
+                {
+                    return nullptr;
+                }
+                break;
+            case Route_NumberList:
+                if (!ParseNumberList(segment, parameters_.m_list))
+                {
+                    return nullptr;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+
+        if (!next)
+        {
+            return nullptr;
+        }
+        node = next;
+    }
+
+    return node->m_route;
+}
+
+bool RouteTable::ParseNumber (boost::string_ref text_, uint32& number_)
+{
+    if (text_.empty() || text_.size() > 10)
+    {
+        return false;
+    }
+
+    uint64 value = 0;
+    for (size_t i = 0; i < text_.size(); i++)
+    {
+        if (text_[i] < '0' || text_[i] > '9')
+        {
+            return false;
+        }
+        value = value*10 + (text_[i]-'0');
+    }
+
+    if (value > 0xFFFFFFFF)
+    {
+        return false;
+    }
+    number_ = (uint32)value;
+    return true;
+}
+
+bool RouteTable::ParseNumberList (boost::string_ref text_, std::vector<uint32>& list_)
+{
+    list_.clear();
+    while (!text_.empty())
+    {
+        size_t separator = text_.find(';');
+        uint32 number = 0;
+        if (!ParseNumber(text_.substr(0, separator), number))
+        {
+            return false;
+        }
+        list_.push_back(number);
+        text_ = (separator == boost::string_ref::npos) ? boost::string_ref() : text_.substr(separator+1);
+    }
+    return !list_.empty();
+}
+
+bool RouteTable::DecodeString (boost::string_ref text_, std::string& string_)
+{
+    string_.clear();
+    string_.reserve(text_.size());
+    for (size_t i = 0; i < text_.size(); i++)
+    {
+        if (text_[i] == '%')
+        {
+            int high = (i+2 < text_.size()) ? HexValue(text_[i+1]) : -1;
+            int low = (high >= 0) ? HexValue(text_[i+2]) : -1;
+            if (low < 0)
+            {
+                return false;
+            }
+            string_.push_back((char)((high << 4) | low));
+            i += 2;
+        }
+        else
+        {
+            string_.push_back(text_[i]);
+        }
+    }
+    return !string_.empty();
+}
+
+void RouteTable::_Insert (const Route* route_)
+{
+    boost::string_ref pattern(route_->m_pattern);
+    Node* node = m_root;
+    uint32 parameterCount = 0;
+
+    while (!pattern.empty())
+    {
+        boost::string_ref segment = NextSegment(pattern);
+        RouteParameterType type = GetParameterType(segment);
+
+        if (type != Route_Literal)
+        {
+            if (!node->m_parameter)
+            {
+                node->m_parameter = new Node();
+                node->m_parameter->m_parameterType = type;
+            }
+            else if (node->m_parameter->m_parameterType != type)
+            {
+                throw std::logic_error(std::string("Conflicting parameter types in route ") + route_->m_pattern);
+            }
+            node = node->m_parameter;
+            parameterCount++;
+            continue;
+        }
+
+        Node* next = nullptr;
+        for (std::vector<std::pair<std::string, Node*>>::iterator it = node->m_literals.begin(); it != node->m_literals.end(); it++)
+        {
+            if (segment == (*it).first)
+            {
+                next = (*it).second;
+                break;
+            }
+        }
+        if (!next)
+        {
+            next = new Node();
+            node->m_literals.push_back(std::make_pair(std::string(segment.data(), segment.size()), next));
+        }
+        node = next;
+    }
+
+    assert(parameterCount <= ROUTE_MAX_PARAMETERS);
+    if (node->m_route)
+    {
+        throw std::logic_error(std::string("Duplicated route ") + route_->m_pattern);
+    }
+    node->m_route = route_;
+}
+
+void RouteTable::_Release (Node* node_)
+{
+    if (!node_)
+    {
+        return;
+    }
+    for (std::vector<std::pair<std::string, Node*>>::iterator it = node_->m_literals.begin(); it != node_->m_literals.end(); it++)
+    {
+        _Release((*it).second);
+    }
+    _Release(node_->m_parameter);
+    delete node_;
+}
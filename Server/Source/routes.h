@@ -0,0 +1,93 @@
+#ifndef _ROUTES_H_
+#define _ROUTES_H_
+
+#include "types.h"
+#include "responseCache.h"
+#include <string>
+#include <vector>
+#include <boost/utility/string_ref.hpp>
+
+#define ROUTE_MAX_PARAMETERS            4
+
+class Connection;
+struct Route;
+
+enum RouteParameterType
+{
+    Route_Literal,
+    Route_Number,       // {number}: decimal uint32
+    Route_String,       // {string}: percent decoded text
+    Route_NumberList    // {list}: uint32 values separated by ';'
+};
+
+struct RouteParameters
+{
+    RouteParameters ()
+     :m_count(0)
+    {};
+    uint32 m_count;
+    uint32 m_numbers[ROUTE_MAX_PARAMETERS];
+    std::string m_strings[ROUTE_MAX_PARAMETERS];
+    std::vector<uint32> m_list;
+};
+
+///
+/// Encodes the request for a route and dispatches it. Returns false to answer 400 Bad Request.
+///
+typedef bool (*RouteHandler) (const Route& route_, const RouteParameters& parameters_, Connection* connection_);
+
+struct Route
+{
+    const char* m_pattern;
+    const char* m_destination;
+    const char* m_operation;
+    RouteHandler m_handler;
+    CachePolicy m_cache;
+    // The operation only reads, a task may be sent to a second worker by the Hedger.
+    bool m_isIdempotent;
+};
+
+///
+/// Prefix tree over path segments, built once from a declarative route list.
+/// Matching walks one node per segment and parses typed parameters on the way, without exceptions.
+///
+class RouteTable
+{
+public:
+    RouteTable (const Route* routes_, size_t routeCount_);
+    ~RouteTable ();
+
+    ///
+    /// Finds the route of path_ and fills parameters_ with its typed parameters.
+    /// @return The matching route, or nullptr if no route matches or a parameter is malformed.
+    ///
+    const Route* Match (boost::string_ref path_, RouteParameters& parameters_) const;
+
+    static bool ParseNumber (boost::string_ref text_, uint32& number_);
+    static bool ParseNumberList (boost::string_ref text_, std::vector<uint32>& list_);
+    static bool DecodeString (boost::string_ref text_, std::string& string_);
+
+private:
+    struct Node
+    {
+        Node ()
+         :m_parameter(nullptr),
+         m_parameterType(Route_Literal),
+         m_route(nullptr)
+        {};
+        std::vector<std::pair<std::string, Node*>> m_literals;
+        Node* m_parameter;
+        RouteParameterType m_parameterType;
+        const Route* m_route;
+    };
+
+    void _Insert (const Route* route_);
+    void _Release (Node* node_);
+
+    Node* m_root;
+
+    RouteTable (const RouteTable&);
+    RouteTable& operator= (const RouteTable&);
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef _STRIPEDLRU_H_
+#define _STRIPEDLRU_H_
+
+#include "types.h"
+#include <string>
+#include <list>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
+
+///
+/// String keyed LRU map split in Stripes independent parts, for the caches read by every I/O
+/// thread. Each stripe keeps its own lock and LRU order, a key always falls in the same stripe.
+/// The caller locks GetMutex() of the stripe around Find(), Insert() and Erase().
+/// @tparam Value Type of the cached values, default constructible.
+///
+template<typename Value, uint32 Stripes>
+class StripedLru
+{
+public:
+    StripedLru ()
+        :m_stripeCapacity(0)
+    {
+    }
+
+    // Bounds the number of entries. Must be set before the I/O threads start, the map stays empty until then.
+    void SetCapacity (uint32 entries_)
+    {
+        m_stripeCapacity = (entries_+Stripes-1)/Stripes;
+    }
+
+    bool IsEnabled () const
+    {
+        return m_stripeCapacity != 0;
+    }
+
+    uint32 GetStripe (const std::string& key_) const
+    {
+        return (uint32)(boost::hash<std::string>()(key_) % Stripes);
+    }
+
+    boost::mutex& GetMutex (uint32 stripe_)
+    {
+        return m_stripes[stripe_].m_mutex;
+    }
+
+    // Gets the value of key_ and makes it the most recently used, NULL if it is not cached.
+    Value* Find (uint32 stripe_, const std::string& key_)
+    {
+        Stripe& stripe = m_stripes[stripe_];
+        typename boost::unordered_map<std::string, Entry>::iterator it = stripe.m_entries.find(key_);
+        if (it == stripe.m_entries.end())
+        {
+            return NULL;
+        }
+        stripe.m_order.splice(stripe.m_order.begin(), stripe.m_order, (*it).second.m_order);
+        return &(*it).second.m_value;
+    }
+
+    // Gets the value of key_, added if it is not cached, and makes it the most recently used.
+    // The least recently used entries of the stripe are dropped to make room.
+    Value& Insert (uint32 stripe_, const std::string& key_)
+    {
+        Stripe& stripe = m_stripes[stripe_];
+        typename boost::unordered_map<std::string, Entry>::iterator it = stripe.m_entries.find(key_);
+        if (it != stripe.m_entries.end())
+        {
+            stripe.m_order.splice(stripe.m_order.begin(), stripe.m_order, (*it).second.m_order);
+            return (*it).second.m_value;
+        }
+
+        while (!stripe.m_order.empty() && stripe.m_entries.size() >= m_stripeCapacity)
+        {
+            _Erase(stripe, stripe.m_entries.find(stripe.m_order.back()));
+        }
+        stripe.m_order.push_front(key_);
+        it = stripe.m_entries.insert(std::make_pair(key_, Entry())).first;
+        (*it).second.m_order = stripe.m_order.begin();
+        return (*it).second.m_value;
+    }
+
+    void Erase (uint32 stripe_, const std::string& key_)
+    {
+        Stripe& stripe = m_stripes[stripe_];
+        typename boost::unordered_map<std::string, Entry>::iterator it = stripe.m_entries.find(key_);
+        if (it != stripe.m_entries.end())
+        {
+            _Erase(stripe, it);
+        }
+    }
+
+private:
+    struct Entry
+    {
+        Value m_value;
+        std::list<std::string>::iterator m_order;
+    };
+
+    struct Stripe
+    {
+        boost::mutex m_mutex;
+        boost::unordered_map<std::string, Entry> m_entries;
+        // Most recently used first.
+        std::list<std::string> m_order;
+    };
+
+    void _Erase (Stripe& stripe_, typename boost::unordered_map<std::string, Entry>::iterator it_)
+    {
+        stripe_.m_order.erase((*it_).second.m_order);
+        stripe_.m_entries.erase(it_);
+    }
+
+    uint32 m_stripeCapacity;
+    Stripe m_stripes[Stripes];
+};
+
+#endif
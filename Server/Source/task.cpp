@@ -2,79 +2,208 @@
 #include "taskHolder.h"
 #include "time.h"
 #include "connection.h"
+#include "responseCache.h"
+#include "metrics.h"
+#include "taskTimeouts.h"
+#include "request.h"
+#include <algorithm>
 #include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/lexical_cast.hpp>
 
-uint32 Task::taskID = 0;
-
-#define TASK_TIMEOUT_MAX        1500
-
-Task::Task (std::string& destination_, std::string& operation_, Connection* connection_, bool GZiped_)
-    :m_taskID(taskID++),
-    m_connection(connection_),
-    m_taskCompleted(false),
-    m_timeout(connection_->GetIOService(), boost::posix_time::milliseconds(TASK_TIMEOUT_MAX)),
+Task::Task (uint32 taskID_, const Route* route_, Connection* connection_)
+    :m_taskCompleted(false),
+    m_isCancelled(false),
+    m_isStreaming(false),
+    m_isRelayable(false),
+    m_isFailed(false),
+    m_taskID(taskID_),
+    m_route(route_),
+    m_retries(0),
+    m_created(boost::posix_time::microsec_clock::universal_time()),
     m_taskResponseSize(0),
     m_isGZiped(true) // Temporary will stay like this
 {
-    m_timeout.async_wait(boost::bind(&Task::TaskTimeOut, this));
-    connection_->SetRelatedTask(this);
+    m_cache.m_ttl = 0;
+    m_cache.m_staleTTL = 0;
+    m_timeout.SetHandler(boost::bind(&Task::TaskTimeOut, this, boost::asio::placeholders::error));
+    // The wheel of the shard of the task, in the low bits of its id.
+    TimerWheel::Get(taskID_).Schedule(m_timeout, TaskTimeouts::GetInstance().GetTimeout(route_));
+    if (connection_)
+    {
+        m_connections.push_back(connection_);
+        connection_->SetRelatedTask(this);
+        m_isRelayable = connection_->AcceptsGzip();
+    }
 }
 
 Task::~Task ()
 {
 }
 
- void Task::TaskTimeOut ()
+void Task::TaskTimeOut (const boost::system::error_code& error_)
 {
-    if (!m_taskCompleted)
+    // Also reached when the task is completed or cancelled, the timer owns the task lifetime.
+    (void)error_;
+    bool timedOut = false;
     {
-        const char service_unavailable[] = "HTTP/1.0 408 Request Timeout\r\n"
-         "Content-Length: 40\r\n"
-         "Content-Type: application/json\r\n"
-         "Connection: close\r\n"
-         "\r\n"
-         "{\"success\":false, \"code\":408, \"data\":{}}\r\n";
-        m_connection->SendAndRelease(service_unavailable, strlen(service_unavailable));
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_isCancelled = true;
+        if (!m_taskCompleted && m_isStreaming)
+        {
+            // The waiters already got part of the response, they can only be closed.
+            timedOut = true;
+            for (size_t i = 0; i < m_connections.size(); i++)
+            {
+                m_connections[i]->AbortTask(m_taskID);
+            }
+            m_connections.clear();
+        }
+        else if (!m_taskCompleted && !m_connections.empty())
+        {
+            std::string request_timeout(Request::s_requestTimeout);
+            m_taskCompleted = true;
+            timedOut = true;
+            _CompleteConnections(request_timeout);
+        }
+    }
+
+    if (timedOut)
+    {
+        Metrics::GetInstance().Increment(Metrics::Counter_Timeouts);
+        TaskTimeouts::GetInstance().Record(m_route, (boost::posix_time::microsec_clock::universal_time()-m_created).total_microseconds());
     }
 
     TaskHolder::GetInstance().FreeTask(this);
 }
 
- void Task::CancelTask ()
+bool Task::AddConnection (Connection* connection_)
+{
+    if (!IsRunning())
+    {
+        return false;
+    }
+
+    // Joining a streamed response needs what was already sent, only kept for the cache.
+    if (m_isStreaming && m_cache.m_ttl == 0)
+    {
+        return false;
+    }
+
+    m_connections.push_back(connection_);
+    connection_->SetRelatedTask(this);
+    m_isRelayable = false;
+    if (m_isStreaming)
+    {
+        connection_->StreamTask(m_taskID, boost::make_shared<const std::string>(m_taskResponse), false);
+    }
+    return true;
+}
+
+void Task::DetachConnection (Connection* connection_)
+{
+    m_connections.erase(std::remove(m_connections.begin(), m_connections.end(), connection_), m_connections.end());
+    if (m_connections.empty() && m_cache.m_ttl == 0)
+    {
+        m_isCancelled = true;
+        m_timeout.Cancel();
+    }
+}
+
+bool Task::IsRunning () const
+{
+    return !m_taskCompleted && !m_isCancelled;
+}
+
+bool Task::IsWaitingForWorker () const
 {
-    boost::system::error_code error;
-    m_timeout.cancel(error);
+    return IsRunning() && !m_isStreaming;
+}
+
+bool Task::Retry ()
+{
+    if (m_retries >= TASK_MAX_RETRIES)
+    {
+        return false;
+    }
+    m_retries++;
+    return true;
 }
 
 uint32 Task::GetTaskID () const
 {
     return m_taskID;
+}
 
+const boost::posix_time::ptime& Task::GetCreationTime () const
+{
+    return m_created;
 }
 
-void Task::PrepareResponse (size_t responseLength_)
+const Route* Task::GetRoute () const
 {
-    m_taskResponse = "HTTP/1.1 200 OK\r\n";
-    if (m_isGZiped)
+    return m_route;
+}
+
+boost::mutex& Task::GetMutex ()
+{
+    return m_mutex;
+}
+
+void Task::SetKey (const std::string& key_, const CachePolicy& cache_)
+{
+    m_key = key_;
+    m_cache = cache_;
+}
+
+const std::string& Task::GetKey () const
+{
+    return m_key;
+}
+
+bool Task::PrepareResponse (size_t responseLength_, bool isFailure_)
+{
+    if (!IsWaitingForWorker())
     {
-        m_taskResponse.append("Content-Encoding: gzip\r\n");        
+        return false;
     }
-    m_taskResponse.append("Content-Length: ");
-    m_taskResponse.append(boost::lexical_cast<std::string>(responseLength_));
-    m_taskResponse.append("\r\nContent-Type: application/json; charset=UTF-8\r\n\r\n");
+    m_isFailed = isFailure_;
+
+    std::string headers = _BuildHeaders(responseLength_);
     m_taskResponseSize = responseLength_;
+    m_isStreaming = true;
+
+    // The whole response is only kept when it goes to the ResponseCache.
+    if (m_cache.m_ttl)
+    {
+        m_taskResponse = headers;
+        m_taskResponse.reserve(headers.size()+responseLength_);
+    }
+    if (IsResponseComplete())
+    {
+        m_taskCompleted = true;
+    }
+    _StreamConnections(boost::make_shared<const std::string>(headers));
+    return true;
 }
 
-void Task::AppendData (char* data_, size_t length_)
+void Task::AppendData (const char* data_, size_t length_)
 {
-    m_taskResponse.append(data_, length_);
+    if (length_ == 0 || length_ > m_taskResponseSize)
+    {
+        return;
+    }
+
+    if (m_cache.m_ttl)
+    {
+        m_taskResponse.append(data_, length_);
+    }
     m_taskResponseSize -= length_;
     if (IsResponseComplete())
     {
         m_taskCompleted = true;
-        m_taskResponse.append("\r\n");
     }
+    _StreamConnections(boost::make_shared<const std::string>(data_, length_));
 }
 
 bool Task::IsResponseComplete ()
@@ -86,8 +215,82 @@ void Task::SendResponse ()
 {
     if (IsResponseComplete())
     {
-        m_connection->SendAndRelease(m_taskResponse.c_str(), m_taskResponse.length());
+        m_timeout.Cancel();
+        if (m_cache.m_ttl && !m_isFailed)
+        {
+            ResponseCache::GetInstance().Store(m_key, m_taskResponse, m_cache);
+        }
+        // Every waiter got the last part already.
+        m_connections.clear();
+    }
+}
+
+void Task::Fail (std::string& response_)
+{
+    if (!IsWaitingForWorker())
+    {
+        return;
+    }
+    m_taskCompleted = true;
+    m_timeout.Cancel();
+    _CompleteConnections(response_);
+}
+
+Connection* Task::TakeRelay (size_t responseLength_, std::string& headers_)
+{
+    if (!IsRunning() || m_isStreaming || !m_isRelayable || m_cache.m_ttl || m_connections.size() != 1 || !m_connections.front()->CanRelay(m_taskID))
+    {
+        return NULL;
+    }
+
+    Connection* connection = m_connections.front();
+    m_connections.clear();
+    headers_ = _BuildHeaders(responseLength_);
+    m_isStreaming = true;
+    m_taskCompleted = true;
+    m_taskResponseSize = 0;
+    m_timeout.Cancel();
+    return connection;
+}
+
+std::string Task::_BuildHeaders (size_t responseLength_)
+{
+    std::string headers = "HTTP/1.1 200 OK\r\n";
+    if (m_isGZiped)
+    {
+        headers.append("Content-Encoding: gzip\r\n");
+    }
+    headers.append("Vary: Accept-Encoding\r\n");
+    headers.append("Content-Length: ");
+    headers.append(boost::lexical_cast<std::string>(responseLength_));
+    headers.append("\r\nContent-Type: application/json; charset=UTF-8\r\n\r\n");
+    return headers;
+}
+
+void Task::_StreamConnections (const boost::shared_ptr<const std::string>& part_)
+{
+    for (size_t i = 0; i < m_connections.size(); i++)
+    {
+        m_connections[i]->StreamTask(m_taskID, part_, m_taskCompleted);
+    }
+}
+
+void Task::_CompleteConnections (std::string& response_)
+{
+    // Every connection gets its own copy, the last one takes the original.
+    for (size_t i = 0; i < m_connections.size(); i++)
+    {
+        if (i+1 == m_connections.size())
+        {
+            m_connections[i]->CompleteTask(m_taskID, response_);
+        }
+        else
+        {
+            std::string response(response_);
+            m_connections[i]->CompleteTask(m_taskID, response);
+        }
     }
+    m_connections.clear();
 }
 
 bool Task::operator==(const Task& other_)
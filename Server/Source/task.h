@@ -2,74 +2,106 @@
 #define _TASK_H_
 
 #include "types.h"
+#include "responseCache.h"
+#include "timerWheel.h"
 #include <string>
 #include <vector>
 #include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+// Dispatches of a task to another worker after the one it was sent to closed.
+#define TASK_MAX_RETRIES        2
 
 class Connection;
+struct Route;
 
+// Besides the constructor, GetTaskID() and TaskTimeOut(), the task must be locked by TaskHolder::Find()
+// before any of its methods is called.
 class Task
 {
 public:
-    Task (std::string& destination_, std::string& operation_, Connection* connection_, bool GZiped_);
+    // connection_ may be NULL for a task that only refreshes the ResponseCache.
+    Task (uint32 taskID_, const Route* route_, Connection* connection_);
     ~Task ();
 
-    void TaskTimeOut ();
+    void TaskTimeOut (const boost::system::error_code& error_);
+
+    // Makes connection_ wait for this task as well, false once the task is answered.
+    bool AddConnection (Connection* connection_);
 
-    void CancelTask ();
+    // connection_ does not wait for the response anymore, a task nobody waits for is cancelled
+    // unless its response goes to the ResponseCache.
+    void DetachConnection (Connection* connection_);
+
+    // Neither answered nor cancelled, connections can still join it.
+    bool IsRunning () const;
+    // Running and no worker started to answer it yet.
+    bool IsWaitingForWorker () const;
+    // Counts a dispatch to another worker after one closed, false once TASK_MAX_RETRIES were made.
+    bool Retry ();
 
     uint32 GetTaskID () const;
+    const boost::posix_time::ptime& GetCreationTime () const;
+    const Route* GetRoute () const;
+
+    boost::mutex& GetMutex ();
 
-    void PrepareResponse (size_t responseLength_);
-    void AppendData (char* data_, size_t length_);
+    // Only before the task is sent to a worker.
+    void SetKey (const std::string& key_, const CachePolicy& cache_);
+    const std::string& GetKey () const;
+
+    // The headers and every part of the body are forwarded to the waiting connections as they come.
+    // PrepareResponse() returns false if the task is no longer waiting for a worker: another worker
+    // answered the hedged task first, or it timed out. The body must be skipped then.
+    // A failed response is forwarded like any other, it only never goes to the ResponseCache.
+    bool PrepareResponse (size_t responseLength_, bool isFailure_);
+    void AppendData (const char* data_, size_t length_);
     bool IsResponseComplete ();
 
     void SendResponse ();
 
+    // Answers every waiter with response_ when no worker took the task, the task is completed.
+    void Fail (std::string& response_);
+
+    ///
+    /// Hands the body over to a relay between the worker and the only waiting connection, which must
+    /// take gzip, not share the task with anyone else and have nothing to write before it, see
+    /// Connection::CanRelay(). The task is completed by the call.
+    /// @param[out] headers_ The response headers.
+    /// @return The connection to relay to, NULL if the response cannot be relayed.
+    ///
+    Connection* TakeRelay (size_t responseLength_, std::string& headers_);
+
     bool operator==(const Task& other_);
     bool operator==(const Task* other_);
 
 private:
-
-    volatile bool m_taskCompleted;
+    std::string _BuildHeaders (size_t responseLength_);
+    void _CompleteConnections (std::string& response_);
+    void _StreamConnections (const boost::shared_ptr<const std::string>& part_);
+
+    bool m_taskCompleted;
+    bool m_isCancelled;
+    // The headers went out, the waiters cannot get another response anymore.
+    bool m_isStreaming;
+    // Still waited for by its creator only, which takes gzip.
+    bool m_isRelayable;
+    // The worker flagged the response as an error.
+    bool m_isFailed;
     uint32 m_taskID;
-    Connection* m_connection;
-    boost::asio::deadline_timer m_timeout;
+    const Route* m_route;
+    uint32 m_retries;
+    std::vector<Connection*> m_connections;
+    boost::mutex m_mutex;
+    TimerWheel::Timer m_timeout;
+    boost::posix_time::ptime m_created;
     std::string m_taskResponse;
     uint32 m_taskResponseSize;
     bool m_isGZiped;
-    static uint32 taskID;
-};
-
-class TaskSelector
-{
-public:
-    TaskSelector (uint32 taskID_)
-        :m_taskID(taskID_)
-    {
-    }
-
-    inline bool operator () (const Task* first)
-    {
-        return (first->GetTaskID() == m_taskID);
-    }
-
-    inline bool operator () (const Task& first)
-    {
-        return (first.GetTaskID() == m_taskID);
-    }
-
-    inline bool operator == (const Task* first)
-    {
-        return (first->GetTaskID() == m_taskID);
-    }
-
-    inline bool operator == (const Task& first)
-    {
-        return (first.GetTaskID() == m_taskID);
-    }
-private:
-    int m_taskID;
+    std::string m_key;
+    CachePolicy m_cache;
 };
 
 #endif
@@ -3,39 +3,167 @@
 #include "connection.h"
 #include <algorithm>
 
+TaskHolder::Shard::Shard ()
+    :m_taskAllocator(100, 1.5),
+    m_taskCount(0)
+{
+}
+
 TaskHolder::TaskHolder()
-    :m_taskAllocator(100, 1.5)
 {
 }
 
-Task* TaskHolder::CreateTask (std::string destination_, std::string operation_, Connection* connection_)
+Task* TaskHolder::CreateTask (const Route& route_, Connection* connection_, const std::string& key_, const CachePolicy& cache_, bool& joined_)
+{
+    uint32 shardIndex = connection_->GetShard();
+    Shard& shard = m_shards[shardIndex];
+    boost::lock_guard<boost::mutex> lock(shard.m_mutex);
+
+    joined_ = false;
+    if (!key_.empty())
+    {
+        boost::unordered_map<std::string, Task*>::iterator it = shard.m_runningTasks.find(key_);
+        if (it != shard.m_runningTasks.end())
+        {
+            Task* task = (*it).second;
+            boost::lock_guard<boost::mutex> taskLock(task->GetMutex());
+            if (task->AddConnection(connection_))
+            {
+                joined_ = true;
+                return task;
+            }
+        }
+    }
+
+    return _CreateTask(shard, shardIndex, route_, connection_, key_, cache_);
+}
+
+Task* TaskHolder::CreateRefreshTask (const Route& route_, Connection* connection_, const std::string& key_, const CachePolicy& cache_)
 {
-    Task* task = new(m_taskAllocator) Task(destination_, operation_, connection_, true);
-    m_taskList.push_back(task);
+    uint32 shardIndex = connection_->GetShard();
+    Shard& shard = m_shards[shardIndex];
+    boost::lock_guard<boost::mutex> lock(shard.m_mutex);
+
+    boost::unordered_map<std::string, Task*>::iterator it = shard.m_runningTasks.find(key_);
+    if (it != shard.m_runningTasks.end())
+    {
+        Task* task = (*it).second;
+        boost::lock_guard<boost::mutex> taskLock(task->GetMutex());
+        if (task->IsRunning())
+        {
+            return NULL;
+        }
+    }
+
+    return _CreateTask(shard, shardIndex, route_, NULL, key_, cache_);
+}
+
+Task* TaskHolder::_CreateTask (Shard& shard_, uint32 shardIndex_, const Route& route_, Connection* connection_, const std::string& key_, const CachePolicy& cache_)
+{
+    uint32 slot = 0;
+    if (shard_.m_freeSlots.size() < TASK_MIN_FREE_SLOTS && shard_.m_slots.size() < (1 << TASK_SLOT_BITS))
+    {
+        slot = shard_.m_slots.size();
+        Shard::Slot empty = { NULL, 0 };
+        shard_.m_slots.push_back(empty);
+    }
+    else if (!shard_.m_freeSlots.empty())
+    {
+        slot = shard_.m_freeSlots.front();
+        shard_.m_freeSlots.pop_front();
+    }
+    else
+    {
+        return NULL;
+    }
+
+    Shard::Slot& entry = shard_.m_slots[slot];
+    uint32 taskID = (entry.m_generation << (TASK_SLOT_BITS+SERVER_SHARD_BITS)) | (slot << SERVER_SHARD_BITS) | shardIndex_;
+    Task* task = new(shard_.m_taskAllocator) Task(taskID, &route_, connection_);
+    task->SetKey(key_, cache_);
+    entry.m_task = task;
+    shard_.m_taskCount++;
+    if (!key_.empty())
+    {
+        // Replaces an answered task that is not released yet.
+        shard_.m_runningTasks[key_] = task;
+    }
     return task;
 }
 
 void TaskHolder::FreeTask (Task* task_)
 {
-    m_taskList.remove(task_);
+    Shard& shard = m_shards[task_->GetTaskID() & (SERVER_MAX_SHARDS-1)];
+    {
+        boost::lock_guard<boost::mutex> lock(shard.m_mutex);
+        uint32 slot = (task_->GetTaskID() >> SERVER_SHARD_BITS) & ((1 << TASK_SLOT_BITS)-1);
+        Shard::Slot& entry = shard.m_slots[slot];
+        entry.m_task = NULL;
+        entry.m_generation = (entry.m_generation+1) & ((1 << TASK_GENERATION_BITS)-1);
+        shard.m_freeSlots.push_back(slot);
+        shard.m_taskCount--;
+        if (!task_->GetKey().empty())
+        {
+            boost::unordered_map<std::string, Task*>::iterator it = shard.m_runningTasks.find(task_->GetKey());
+            if (it != shard.m_runningTasks.end() && (*it).second == task_)
+            {
+                shard.m_runningTasks.erase(it);
+            }
+        }
+    }
+
+    // Nobody can find the task anymore, waits for whoever found it before.
+    task_->GetMutex().lock();
+    task_->GetMutex().unlock();
 
-    m_taskAllocator.Release(task_);
+    boost::lock_guard<boost::mutex> lock(shard.m_mutex);
+    shard.m_taskAllocator.Release(task_);
 }
 
 Task* TaskHolder::Find (uint32 taskID_)
 {
-    TaskSelector selector(taskID_);
-    std::list<Task*>::iterator it = std::find_if(m_taskList.begin(), m_taskList.end(), selector);
+    Shard& shard = m_shards[taskID_ & (SERVER_MAX_SHARDS-1)];
+    boost::lock_guard<boost::mutex> lock(shard.m_mutex);
+    uint32 slot = (taskID_ >> SERVER_SHARD_BITS) & ((1 << TASK_SLOT_BITS)-1);
+    if (slot >= shard.m_slots.size())
+    {
+        return NULL;
+    }
 
-    if (it != m_taskList.end())
+    // A freed slot has no task, a reused one another generation.
+    Task* task = shard.m_slots[slot].m_task;
+    if (!task || task->GetTaskID() != taskID_)
     {
-        return (*it);
+        return NULL;
+    }
+    task->GetMutex().lock();
+    return task;
+}
+
+void TaskHolder::GetStatistics (uint32& tasks_, uint32& running_, size_t& capacity_)
+{
+    tasks_ = running_ = 0;
+    capacity_ = 0;
+    for (uint32 i = 0; i < SERVER_MAX_SHARDS; i++)
+    {
+        Shard& shard = m_shards[i];
+        boost::lock_guard<boost::mutex> lock(shard.m_mutex);
+        tasks_ += shard.m_taskCount;
+        capacity_ += shard.m_taskAllocator.GetCapacity();
+        for (size_t j = 0; j < shard.m_slots.size(); j++)
+        {
+            Task* task = shard.m_slots[j].m_task;
+            if (task)
+            {
+                boost::lock_guard<boost::mutex> taskLock(task->GetMutex());
+                running_ += task->IsRunning();
+            }
+        }
     }
-    return NULL;
 }
 
 TaskHolder& TaskHolder::GetInstance()
 {
     static TaskHolder instance;
     return instance;
-}
\ No newline at end of file
+}
@@ -3,28 +3,87 @@
 
 #include "allocator.h"
 #include "requestTypes.h"
+#include "config.h"
+#include "responseCache.h"
 #include <string>
-#include <list>
+#include <vector>
+#include <deque>
+#include <boost/asio.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+// A task id is its generation, its slot and its shard, from the high bits to the low ones.
+#define TASK_SLOT_BITS                  16
+#define TASK_GENERATION_BITS            (32-TASK_SLOT_BITS-SERVER_SHARD_BITS)
+// Free slots kept aside, a slot is only reused after that many other tasks, so the generation
+// of a late worker reply has long changed.
+#define TASK_MIN_FREE_SLOTS             1024
 
 class Task;
 struct bufferevent;
 class Connection;
+struct Route;
 
+// Tasks are split in one shard per I/O shard, a task lives in the shard of its connection and
+// its id tells the shard back, so only the worker replies cross shards. Identical requests are
+// shared within a shard. The tasks of a shard live in a slot map indexed by the task id, a stale id
+// does not match the generation of its slot anymore.
 class TaskHolder
 {
 public:
-    Task* CreateTask (std::string destination_, std::string operation_, Connection* connection_);
+    ///
+    /// Creates the task answering connection_, or attaches connection_ to the running task with the same key_.
+    /// @param[in] route_ The route the request came from, it gives the task timeout.
+    /// @param[in] key_ Identifies the request, empty if it must not be shared.
+    /// @param[in] cache_ How long the completed response stays in the ResponseCache.
+    /// @param[out] joined_ true if an identical task was already running, there is nothing to send then.
+    /// @return NULL if the shard holds too many tasks already.
+    ///
+    Task* CreateTask (const Route& route_, Connection* connection_, const std::string& key_, const CachePolicy& cache_, bool& joined_);
+
+    ///
+    /// Creates a task nobody waits for, refreshing the stale cached response of key_ in the shard of connection_.
+    /// @return NULL if a task with the same key is already running, or the shard is full.
+    ///
+    Task* CreateRefreshTask (const Route& route_, Connection* connection_, const std::string& key_, const CachePolicy& cache_);
 
     void FreeTask (Task* task_);
 
+    // Returns the task with its mutex locked, the caller must unlock it. NULL if the task is gone.
     Task* Find (uint32 taskID_);
 
+    // Tasks held, the running ones among them, and the capacity of the task pools, over every shard.
+    void GetStatistics (uint32& tasks_, uint32& running_, size_t& capacity_);
+
     static TaskHolder& GetInstance();
 private:
     TaskHolder();
 
-    utils::MemoryPool<Task> m_taskAllocator;
-    std::list<Task*> m_taskList;
+    struct Shard
+    {
+        Shard ();
+        boost::mutex m_mutex;
+        utils::MemoryPool<Task> m_taskAllocator;
+        struct Slot
+        {
+            Task* m_task;
+            uint32 m_generation;
+        };
+        std::vector<Slot> m_slots;
+        // Oldest freed first.
+        std::deque<uint32> m_freeSlots;
+        uint32 m_taskCount;
+        // Running tasks by key, so identical requests share a single worker call.
+        boost::unordered_map<std::string, Task*> m_runningTasks;
+        // Keeps two shards off the same cache line.
+        char m_padding[64];
+    };
+
+    // The shard must be locked. NULL if every slot is taken.
+    Task* _CreateTask (Shard& shard_, uint32 shardIndex_, const Route& route_, Connection* connection_, const std::string& key_, const CachePolicy& cache_);
+
+    Shard m_shards[SERVER_MAX_SHARDS];
 };
 
-#endif
\ No newline at end of file
+#endif
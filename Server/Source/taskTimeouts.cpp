@@ -0,0 +1,104 @@
+#include "taskTimeouts.h"
+#include "routes.h"
+#include "config.h"
+#include <algorithm>
+
+TaskTimeouts::TaskTimeouts ()
+    :m_routes(NULL),
+    m_routeCount(0),
+    m_isAdaptive(false),
+    m_isRecording(false)
+{
+    for (uint32 i = 0; i < METRICS_MAX_ROUTES; i++)
+    {
+        m_timeouts[i] = 0;
+        m_hedgeDelays[i] = 0;
+        m_samples[i] = 0;
+    }
+}
+
+void TaskTimeouts::SetRoutes (const Route* routes_, size_t routeCount_)
+{
+    const Config& config = Config::GetInstance();
+    m_isAdaptive = config.IsAdaptiveTimeout();
+    m_isRecording = m_isAdaptive || config.GetHedgeBudget();
+    m_routeCount = std::min<size_t>(routeCount_, METRICS_MAX_ROUTES);
+    for (size_t i = 0; i < m_routeCount; i++)
+    {
+        m_timeouts[i] = config.GetRouteTimeout(routes_[i].m_pattern);
+    }
+    m_routes = routes_;
+}
+
+uint32 TaskTimeouts::GetTimeout (const Route* route_) const
+{
+    size_t index = 0;
+    if (_GetIndex(route_, index))
+    {
+        return m_timeouts[index].load(boost::memory_order_relaxed);
+    }
+    return Config::GetInstance().GetTaskTimeout();
+}
+
+uint32 TaskTimeouts::GetHedgeDelay (const Route* route_) const
+{
+    size_t index = 0;
+    if (_GetIndex(route_, index))
+    {
+        return m_hedgeDelays[index].load(boost::memory_order_relaxed);
+    }
+    return 0;
+}
+
+void TaskTimeouts::Record (const Route* route_, uint64 microseconds_)
+{
+    size_t index = 0;
+    if (!m_isRecording || !_GetIndex(route_, index))
+    {
+        return;
+    }
+
+    m_latency[index].Record(microseconds_);
+    // Only the thread completing the window updates the timeout.
+    if (m_samples[index].fetch_add(1, boost::memory_order_relaxed)+1 == TASK_TIMEOUT_SAMPLES)
+    {
+        _Adapt(index);
+    }
+}
+
+bool TaskTimeouts::_GetIndex (const Route* route_, size_t& index_) const
+{
+    if (!route_ || !m_routes)
+    {
+        return false;
+    }
+    index_ = route_-m_routes;
+    return index_ < m_routeCount;
+}
+
+void TaskTimeouts::_Adapt (size_t index_)
+{
+    const Config& config = Config::GetInstance();
+    uint64 count = 0;
+    uint64 p95 = m_latency[index_].GetPercentile(0.95, count);
+    uint64 p99 = m_latency[index_].GetPercentile(0.99, count);
+    m_latency[index_].Reset();
+    m_samples[index_].store(0, boost::memory_order_relaxed);
+
+    m_hedgeDelays[index_].store((uint32)std::max<uint64>(p95/1000, 1), boost::memory_order_relaxed);
+    if (!m_isAdaptive)
+    {
+        return;
+    }
+
+    uint64 timeout = (uint64)(p99/1000.0*config.GetAdaptiveTimeoutFactor());
+    timeout = std::max<uint64>(timeout, config.GetAdaptiveTimeoutMin());
+    timeout = std::min<uint64>(timeout, config.GetAdaptiveTimeoutMax());
+    m_timeouts[index_].store((uint32)timeout, boost::memory_order_relaxed);
+}
+
+TaskTimeouts& TaskTimeouts::GetInstance ()
+{
+    static TaskTimeouts instance;
+    return instance;
+}
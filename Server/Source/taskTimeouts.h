@@ -0,0 +1,57 @@
+#ifndef _TASKTIMEOUTS_H_
+#define _TASKTIMEOUTS_H_
+
+#include "types.h"
+#include "metrics.h"
+#include <boost/atomic.hpp>
+
+// Task latencies of a route between two updates of its adaptive timeout.
+#define TASK_TIMEOUT_SAMPLES            256
+
+struct Route;
+
+///
+/// Milliseconds a task of each route waits for a worker before its connections get 408 Request
+/// Timeout. The timeouts come from config.lua. In the adaptive mode the timeout of a route follows
+/// the latency of its tasks: every TASK_TIMEOUT_SAMPLES tasks it becomes their p99 times a factor,
+/// kept within a floor and a ceiling. Tasks that timed out count as taking the whole timeout, so a
+/// route whose tasks time out too often gets a longer one.
+/// Each update also sets the p95 latency of the route, after which its tasks are hedged.
+///
+class TaskTimeouts
+{
+public:
+    // Registers the route table and reads the timeouts of its routes from the Config.
+    void SetRoutes (const Route* routes_, size_t routeCount_);
+
+    // Timeout of the tasks of route_, the default one for a NULL route.
+    uint32 GetTimeout (const Route* route_) const;
+
+    // Milliseconds before a task of route_ is sent to a second worker, 0 until the route has a p95.
+    uint32 GetHedgeDelay (const Route* route_) const;
+
+    // Time a worker took to answer a task of route_, or the timeout of a task it never answered.
+    void Record (const Route* route_, uint64 microseconds_);
+
+    static TaskTimeouts& GetInstance ();
+
+private:
+    TaskTimeouts ();
+
+    // Position of route_ in the registered routes, false for NULL or an unknown route.
+    bool _GetIndex (const Route* route_, size_t& index_) const;
+    void _Adapt (size_t index_);
+
+    const Route* m_routes;
+    size_t m_routeCount;
+    bool m_isAdaptive;
+    // The latencies are only needed by the adaptive mode and the Hedger.
+    bool m_isRecording;
+    boost::atomic<uint32> m_timeouts[METRICS_MAX_ROUTES];
+    boost::atomic<uint32> m_hedgeDelays[METRICS_MAX_ROUTES];
+    // Only the latencies since the last update.
+    Histogram m_latency[METRICS_MAX_ROUTES];
+    boost::atomic<uint32> m_samples[METRICS_MAX_ROUTES];
+};
+
+#endif
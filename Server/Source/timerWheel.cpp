@@ -0,0 +1,219 @@
+#include "timerWheel.h"
+#include <algorithm>
+#include <boost/bind.hpp>
+
+#define TIMER_WHEEL_MASK                ((1 << TIMER_WHEEL_BITS)-1)
+#define TIMER_WHEEL_LEVEL_MASK          ((1 << TIMER_WHEEL_LEVEL_BITS)-1)
+#define TIMER_WHEEL_NOT_ARMED           (~(uint64)0)
+
+TimerWheel::Timer::Timer ()
+    :m_previous(NULL),
+    m_next(NULL),
+    m_wheel(NULL),
+    m_expiry(0),
+    m_isPending(false)
+{
+}
+
+void TimerWheel::Timer::SetHandler (const Handler& handler_)
+{
+    m_handler = handler_;
+}
+
+void TimerWheel::Timer::Cancel ()
+{
+    if (!m_wheel)
+    {
+        return;
+    }
+    boost::lock_guard<boost::mutex> lock(m_wheel->m_mutex);
+    if (m_isPending)
+    {
+        m_wheel->_Abort(*this);
+    }
+}
+
+TimerWheel::TimerWheel ()
+    :m_ioService(NULL),
+    m_timer(NULL),
+    m_tick(0),
+    m_armedTick(TIMER_WHEEL_NOT_ARMED),
+    m_timerCount(0),
+    m_isTicking(false)
+{
+    std::fill(m_slots, m_slots+(1 << TIMER_WHEEL_BITS), (Timer*)NULL);
+    for (uint32 i = 0; i < TIMER_WHEEL_LEVELS-1; i++)
+    {
+        std::fill(m_levels[i], m_levels[i]+(1 << TIMER_WHEEL_LEVEL_BITS), (Timer*)NULL);
+    }
+}
+
+void TimerWheel::Start (boost::asio::io_service& io_service_)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    m_ioService = &io_service_;
+    m_timer = new boost::asio::deadline_timer(io_service_);
+    m_start = boost::posix_time::microsec_clock::universal_time();
+}
+
+void TimerWheel::Schedule (Timer& timer_, uint32 milliseconds_)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    if (timer_.m_isPending)
+    {
+        _Abort(timer_);
+    }
+
+    uint64 now = _Now();
+    if (!m_timerCount && m_tick < now)
+    {
+        // Nothing was due while the wheel was empty, it skips the ticks it missed.
+        m_tick = now;
+    }
+
+    // The current millisecond is partly gone, the timer never expires early. It cannot land in a
+    // tick behind the clock either, those are processed first.
+    uint64 expiry = now+std::min<uint64>(milliseconds_, TIMER_WHEEL_SPAN-1)+1;
+    timer_.m_expiry = std::min<uint64>(std::max(expiry, m_tick), m_tick+TIMER_WHEEL_SPAN-1);
+    timer_.m_wheel = this;
+    timer_.m_isPending = true;
+    _Link(timer_);
+    m_timerCount++;
+
+    if (!m_isTicking && timer_.m_expiry < m_armedTick)
+    {
+        _ArmAt(timer_.m_expiry);
+    }
+}
+
+TimerWheel& TimerWheel::Get (uint32 shard_)
+{
+    static TimerWheel wheels[SERVER_MAX_SHARDS];
+    return wheels[shard_ & (SERVER_MAX_SHARDS-1)];
+}
+
+uint64 TimerWheel::_Now () const
+{
+    return (boost::posix_time::microsec_clock::universal_time()-m_start).total_milliseconds();
+}
+
+void TimerWheel::_Link (Timer& timer_)
+{
+    uint64 delta = timer_.m_expiry-m_tick;
+    Timer** slot = &m_slots[timer_.m_expiry & TIMER_WHEEL_MASK];
+    uint32 shift = TIMER_WHEEL_BITS;
+    for (uint32 level = 0; level < TIMER_WHEEL_LEVELS-1 && delta >= ((uint64)1 << shift); level++)
+    {
+        slot = &m_levels[level][(timer_.m_expiry >> shift) & TIMER_WHEEL_LEVEL_MASK];
+        shift += TIMER_WHEEL_LEVEL_BITS;
+    }
+
+    timer_.m_next = *slot;
+    if (timer_.m_next)
+    {
+        timer_.m_next->m_previous = &timer_.m_next;
+    }
+    timer_.m_previous = slot;
+    *slot = &timer_;
+}
+
+void TimerWheel::_Unlink (Timer& timer_)
+{
+    *timer_.m_previous = timer_.m_next;
+    if (timer_.m_next)
+    {
+        timer_.m_next->m_previous = timer_.m_previous;
+    }
+    timer_.m_previous = NULL;
+    timer_.m_next = NULL;
+    timer_.m_isPending = false;
+    m_timerCount--;
+}
+
+void TimerWheel::_Abort (Timer& timer_)
+{
+    _Unlink(timer_);
+    // Never run inline, the caller may hold a lock the handler takes.
+    m_ioService->post(boost::bind(timer_.m_handler, boost::system::error_code(boost::asio::error::operation_aborted)));
+}
+
+void TimerWheel::_Cascade (uint32 level_, uint32 index_)
+{
+    Timer* timer = m_levels[level_][index_];
+    m_levels[level_][index_] = NULL;
+    while (timer)
+    {
+        Timer* next = timer->m_next;
+        _Link(*timer);
+        timer = next;
+    }
+}
+
+void TimerWheel::_Arm ()
+{
+    if (!m_timerCount)
+    {
+        return;
+    }
+
+    // The next expiry of the finest wheel, or the next cascade of the coarser ones.
+    for (uint64 tick = m_tick; tick < m_tick+(1 << TIMER_WHEEL_BITS); tick++)
+    {
+        if (!(tick & TIMER_WHEEL_MASK) || m_slots[tick & TIMER_WHEEL_MASK])
+        {
+            _ArmAt(tick);
+            return;
+        }
+    }
+}
+
+void TimerWheel::_ArmAt (uint64 tick_)
+{
+    m_armedTick = tick_;
+    m_timer->expires_at(m_start+boost::posix_time::milliseconds(tick_));
+    m_timer->async_wait(boost::bind(&TimerWheel::_Tick, this, boost::asio::placeholders::error));
+}
+
+void TimerWheel::_Tick (const boost::system::error_code& error_)
+{
+    if (error_)
+    {
+        // Moved to an earlier tick.
+        return;
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_armedTick = TIMER_WHEEL_NOT_ARMED;
+        m_isTicking = true;
+        uint64 now = _Now();
+        for (; m_tick <= now; m_tick++)
+        {
+            uint32 index = m_tick & TIMER_WHEEL_MASK;
+            uint32 shift = TIMER_WHEEL_BITS;
+            for (uint32 level = 0; !index && level < TIMER_WHEEL_LEVELS-1; level++)
+            {
+                index = (m_tick >> shift) & TIMER_WHEEL_LEVEL_MASK;
+                _Cascade(level, index);
+                shift += TIMER_WHEEL_LEVEL_BITS;
+            }
+
+            while (Timer* timer = m_slots[m_tick & TIMER_WHEEL_MASK])
+            {
+                _Unlink(*timer);
+                m_expired.push_back(timer);
+            }
+        }
+    }
+
+    // The owner of a timer outlives its handler, whatever the other handlers do.
+    for (size_t i = 0; i < m_expired.size(); i++)
+    {
+        m_expired[i]->m_handler(boost::system::error_code());
+    }
+    m_expired.clear();
+
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    m_isTicking = false;
+    _Arm();
+}
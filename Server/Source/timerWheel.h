@@ -0,0 +1,91 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include "types.h"
+#include "config.h"
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+// Slots of the wheel of the next milliseconds, then of each coarser wheel.
+#define TIMER_WHEEL_BITS                8
+#define TIMER_WHEEL_LEVEL_BITS          6
+#define TIMER_WHEEL_LEVELS              3
+// Farthest expiry in milliseconds, about 17 minutes. Later timers expire then.
+#define TIMER_WHEEL_SPAN                (1 << (TIMER_WHEEL_BITS+(TIMER_WHEEL_LEVELS-1)*TIMER_WHEEL_LEVEL_BITS))
+
+///
+/// Hierarchical hashed timing wheel with a millisecond granularity, one per shard, driven by a
+/// single deadline_timer on the io_service of the shard. Scheduling and cancelling a timer are O(1)
+/// under the lock of the wheel, the deadline_timer is only moved when a timer expires before every
+/// other one. The timers are intrusive, their owner embeds them and the wheel never allocates.
+/// Like a deadline_timer, every Schedule() gets exactly one call of the handler: with no error
+/// once expired, or with operation_aborted once cancelled or scheduled again.
+///
+class TimerWheel
+{
+public:
+    typedef boost::function<void (const boost::system::error_code&)> Handler;
+
+    class Timer
+    {
+    public:
+        Timer ();
+
+        // Set once, the handler must fit in the small buffer of boost::function to avoid allocating.
+        void SetHandler (const Handler& handler_);
+        // Aborts the timer if it is pending, can be called from any thread.
+        void Cancel ();
+
+    private:
+        friend class TimerWheel;
+
+        // The pointer to it in its slot or in the timer before it.
+        Timer** m_previous;
+        Timer* m_next;
+        TimerWheel* m_wheel;
+        // Tick of the wheel it expires at.
+        uint64 m_expiry;
+        bool m_isPending;
+        Handler m_handler;
+    };
+
+    // Drives the wheel with the io_service of its shard, before any timer is scheduled.
+    void Start (boost::asio::io_service& io_service_);
+
+    // Arms timer_ to expire in milliseconds_, can be called from any thread. A timer stays on one wheel.
+    void Schedule (Timer& timer_, uint32 milliseconds_);
+
+    static TimerWheel& Get (uint32 shard_);
+
+private:
+    TimerWheel ();
+
+    uint64 _Now () const;
+    void _Link (Timer& timer_);
+    void _Unlink (Timer& timer_);
+    void _Abort (Timer& timer_);
+    void _Cascade (uint32 level_, uint32 index_);
+    void _Arm ();
+    void _ArmAt (uint64 tick_);
+    void _Tick (const boost::system::error_code& error_);
+
+    boost::mutex m_mutex;
+    boost::asio::io_service* m_ioService;
+    boost::asio::deadline_timer* m_timer;
+    boost::posix_time::ptime m_start;
+    // Next tick to process.
+    uint64 m_tick;
+    // Tick the deadline_timer waits for, ~0 when it does not wait.
+    uint64 m_armedTick;
+    uint32 m_timerCount;
+    // _Tick() runs the expired handlers outside of the lock, it arms the deadline_timer afterwards.
+    bool m_isTicking;
+    std::vector<Timer*> m_expired;
+    Timer* m_slots[1 << TIMER_WHEEL_BITS];
+    Timer* m_levels[TIMER_WHEEL_LEVELS-1][1 << TIMER_WHEEL_LEVEL_BITS];
+};
+
+#endif
@@ -1,28 +1,63 @@
 #include "worker.h"
 
+#include <algorithm>
 #include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
 #include "taskHolder.h"
 #include "task.h"
+#include "connection.h"
+#include "config.h"
+#include "taskTimeouts.h"
+#ifdef SPLICE_F_MOVE
+#include <unistd.h>
+#endif
 
-#define MESSAGE_MAX_SIZE        1408-9
 #define TASK_MESSAGE_CREATION   0x01
+// Same layout, the worker answered with an error that must not be cached.
+#define TASK_MESSAGE_FAILURE    0x02
+// Smallest body left in the socket that is worth a relay.
+#define WORKER_RELAY_MIN_LENGTH 65536
+// Latency average of a worker with no answer yet (us), and the weight of a new sample (1/2^n).
+#define WORKER_LATENCY_INITIAL  100000
+#define WORKER_LATENCY_SHIFT    3
+// Sent tasks are forgotten after that many seconds, no task waits that long for its answer.
+#define WORKER_TASK_MAX_AGE     60
+#define WORKER_PRUNE_SIZE       1024
 
 uint32 Worker::s_uidCounter = 1;
 
 Worker::Worker (boost::asio::io_service& io_service_)
-: m_socket(io_service_),
+: m_isReading(false),
+  m_isClosing(false),
+  m_isSubscribed(false),
+  m_isWriting(false),
+  m_isRelaying(false),
+  m_writingCount(0),
+  m_writingLength(0),
+  m_pendingPosts(0),
   m_taskID(0),
+  m_remainingLength(0),
+  m_isDropping(false),
   m_uid(s_uidCounter++),
-  m_isReceiving(false)
+  m_pruneSize(WORKER_PRUNE_SIZE),
+  m_latencyAverage(WORKER_LATENCY_INITIAL),
+  m_outstanding(0),
+  m_socket(io_service_),
+  m_strand(io_service_),
+  m_bufferLength(0)
 {
+    m_relayPipe[0] = m_relayPipe[1] = -1;
 }
 
 Worker::~Worker ()
 {
-    Workers::GetInstance().UnsubscribeWorker(m_uid);
-    Workers::GetInstance().ReleaseCredentials(m_username, m_password);
+    if (!m_username.empty())
+    {
+        Workers::GetInstance().ReleaseCredentials(m_username, m_password);
+    }
 
     CloseConnection();
+    _ClosePipe();
 }
 
 boost::asio::ip::tcp::socket& Worker::GetSocket ()
@@ -35,6 +70,11 @@ uint32 Worker::GetUniqueID ()
     return m_uid;
 }
 
+const std::string& Worker::GetAddress ()
+{
+    return m_address;
+}
+
 void Worker::CloseConnection ()
 {
     boost::system::error_code error;
@@ -44,36 +84,168 @@ void Worker::CloseConnection ()
 
 void Worker::SendData (const char* data_, size_t dataLength_)
 {
-    // Sadly, it must be this way since Microsoft Windows limit on 65536 data.
-    size_t left = dataLength_;
-    while (left > 0)
+    // Only called while the worker is subscribed and the workers list is locked, see _Close().
+    m_pendingPosts++;
+    m_strand.post(boost::bind(&Worker::_SendData, this, boost::make_shared<std::string>(data_, dataLength_)));
+}
+
+void Worker::SendTask (const char* data_, size_t dataLength_)
+{
+    m_outstanding++;
+    m_pendingPosts++;
+    m_strand.post(boost::bind(&Worker::_SendTask, this, boost::make_shared<std::string>(data_, dataLength_)));
+}
+
+void Worker::EndRelay (uint32 unread_, bool pipeEmpty_, bool failed_)
+{
+    m_pendingPosts++;
+    m_strand.post(boost::bind(&Worker::_EndRelay, this, unread_, pipeEmpty_, failed_));
+}
+
+void Worker::WaitRelay (Connection* connection_)
+{
+    m_pendingPosts++;
+    m_strand.post(boost::bind(&Worker::_WaitRelay, this, connection_));
+}
+
+int Worker::GetRelayPipe (int end_) const
+{
+    return m_relayPipe[end_];
+}
+
+const Histogram& Worker::GetLatency () const
+{
+    return m_latency;
+}
+
+uint64 Worker::GetExpectedWait () const
+{
+    return (uint64)(m_outstanding.load(boost::memory_order_relaxed)+1)*m_latencyAverage.load(boost::memory_order_relaxed);
+}
+
+void Worker::_RecordLatency (const Task* task_)
+{
+    // A task hedged or sent again is not charged for the time it spent on another worker.
+    boost::posix_time::ptime sent = m_taskSent.is_not_a_date_time() ? task_->GetCreationTime() : m_taskSent;
+    uint64 latency = (boost::posix_time::microsec_clock::universal_time()-sent).total_microseconds();
+    m_latency.Record(latency);
+    TaskTimeouts::GetInstance().Record(task_->GetRoute(), latency);
+
+    int64 average = m_latencyAverage.load(boost::memory_order_relaxed);
+    average += ((int64)std::min<uint64>(latency, 0xffffffff)-average) >> WORKER_LATENCY_SHIFT;
+    m_latencyAverage.store((uint32)average, boost::memory_order_relaxed);
+}
+
+void Worker::AcceptWorker ()
+{
+    boost::system::error_code error;
+    m_address = m_socket.remote_endpoint(error).address().to_string();
+
+    m_strand.post(boost::bind(&Worker::_Read, this, &Worker::_CheckAccept));
+}
+
+void Worker::_SendData (boost::shared_ptr<std::string> data_)
+{
+    m_pendingPosts--;
+    if (m_isClosing)
+    {
+        _TryRelease();
+        return;
+    }
+
+    m_writeQueue.push_back(data_);
+    _Write();
+}
+
+void Worker::_SendTask (boost::shared_ptr<std::string> data_)
+{
+    uint32 taskID = *(uint32*)&(*data_)[1];
+    if (m_isClosing)
     {
-        uint length = left;
-        if (length > MESSAGE_MAX_SIZE)
+        // Posted before the worker left the list.
+        _Redispatch(taskID, data_);
+    }
+    else
+    {
+        if (m_tasks.size() >= m_pruneSize)
         {
-            length = MESSAGE_MAX_SIZE;
+            _PruneTasks();
         }
+        SentTask& task = m_tasks[taskID];
+        task.m_message = data_;
+        task.m_sent = boost::posix_time::microsec_clock::universal_time();
+    }
+    _SendData(data_);
+}
 
-        boost::asio::async_write(m_socket, boost::asio::buffer(data_, length), 
-                boost::bind(&Worker::_HandleErrors, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+void Worker::_Redispatch (uint32 taskID_, const boost::shared_ptr<std::string>& message_)
+{
+    Task* task = TaskHolder::GetInstance().Find(taskID_);
+    if (!task)
+    {
+        return;
+    }
+    bool isRetried = false;
+    {
+        boost::lock_guard<boost::mutex> lock(task->GetMutex(), boost::adopt_lock);
+        isRetried = task->IsWaitingForWorker() && task->Retry();
+    }
 
-        data_ += length;
-        left -= length;
+    // The task ids keep their shard in the low bits.
+    if (isRetried && Workers::GetInstance().SendToAvailableWorker(taskID_ & (SERVER_MAX_SHARDS-1), message_->data(), message_->size(), m_uid))
+    {
+        Metrics::GetInstance().Increment(Metrics::Counter_Redispatched);
     }
 }
 
-void Worker::AcceptWorker ()
+void Worker::_PruneTasks ()
+{
+    // The answers that never came, the tasks timed out long ago.
+    boost::posix_time::ptime limit = boost::posix_time::microsec_clock::universal_time()-boost::posix_time::seconds(WORKER_TASK_MAX_AGE);
+    for (boost::unordered_map<uint32, SentTask>::iterator it = m_tasks.begin(); it != m_tasks.end();)
+    {
+        if ((*it).second.m_sent < limit)
+        {
+            it = m_tasks.erase(it);
+            m_outstanding--;
+        }
+        else
+        {
+            it++;
+        }
+    }
+    m_pruneSize = std::max<size_t>(WORKER_PRUNE_SIZE, m_tasks.size()*2);
+}
+
+void Worker::_Write ()
 {
-    m_socket.async_read_some(boost::asio::buffer(m_bufferData, max_length), 
-        boost::bind(&Worker::_CheckAccept, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+    if (m_isWriting || m_writeQueue.empty())
+    {
+        return;
+    }
+
+    // Every queued message goes out in a single gathered write, in the order they were sent.
+    m_writeBuffers.clear();
+    m_writingLength = 0;
+    for (std::deque<boost::shared_ptr<std::string>>::iterator it = m_writeQueue.begin(); it != m_writeQueue.end(); it++)
+    {
+        m_writeBuffers.push_back(boost::asio::buffer(**it));
+        m_writingLength += (*it)->length();
+    }
+
+    m_isWriting = true;
+    m_writingCount = m_writeBuffers.size();
+    boost::asio::async_write(m_socket, m_writeBuffers, 
+        m_strand.wrap(boost::bind(&Worker::_HandleErrors, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
 }
 
 void Worker::_CheckAccept (const boost::system::error_code& error_, size_t dataLength_)
 {
+    m_isReading = false;
     if (error_ || dataLength_ <= 17 || m_bufferData[0] != (char)0xFA || strncmp(&m_bufferData[1], "eXMAnHcDl ueTi0", 15) != 0)
     {
         printf("%s", error_.message().c_str());
-        delete this;
+        _Close();
         return;        
     }
     else
@@ -87,83 +259,282 @@ void Worker::_CheckAccept (const boost::system::error_code& error_, size_t dataL
         buffer[buffer[0]+1] = m_password.length();
         sprintf(buffer+buffer[0]+2, "%s", m_password.c_str());
 
-        SendData(buffer, buffer[0]+buffer[buffer[0]+1]+2);
+        m_pendingPosts++;
+        _SendData(boost::make_shared<std::string>(buffer, buffer[0]+buffer[buffer[0]+1]+2));
 
-        m_socket.async_read_some(boost::asio::buffer(m_bufferData, max_length), 
-        boost::bind(&Worker::_WaitConnection, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+        _Read(&Worker::_WaitConnection);
     }
 }
 
 void Worker::_WaitConnection (const boost::system::error_code& error_, size_t dataLength_)
 {
+    m_isReading = false;
     if (error_ || m_bufferData[0] != (char)0xFF)
     {
-        delete this;
+        _Close();
         return;        
     }
     else
     {
+        m_isSubscribed = true;
         Workers::GetInstance().SubscribeWorker(this);
-        m_socket.async_read_some(boost::asio::buffer(m_bufferData, max_length), 
-        boost::bind(&Worker::_ReceiveData, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+        _Read(&Worker::_ReceiveData);
     }
 }
 
 void Worker::_ReceiveData (const boost::system::error_code& error_, size_t dataLength_)
 {
-    if (error_)
+    m_isReading = false;
+    if (error_ || m_isClosing)
     {
-        delete this;
+        _Close();
         return;
     }
-    else if (m_isReceiving)
-    {
-        Task* task = TaskHolder::GetInstance().Find(m_taskID);
 
-        if (task)
+    // A read can end in the middle of a message or hold several of them, the bodies are
+    // forwarded as they come and a cut header waits for the next read.
+    m_bufferLength += dataLength_;
+    size_t offset = 0;
+    while (offset < m_bufferLength)
+    {
+        if (m_remainingLength)
+        {
+            uint32 length = (uint32)std::min<size_t>(m_remainingLength, m_bufferLength-offset);
+            _ForwardData(&m_bufferData[offset], length);
+            m_remainingLength -= length;
+            offset += length;
+        }
+        else if (m_bufferData[offset] == TASK_MESSAGE_CREATION || m_bufferData[offset] == TASK_MESSAGE_FAILURE)
         {
-            task->AppendData(m_bufferData, dataLength_);
-            if (task->IsResponseComplete())
+            if (m_bufferLength-offset < 9)
+            {
+                break;
+            }
+            bool isFailure = (m_bufferData[offset] == TASK_MESSAGE_FAILURE);
+            m_taskID = *(uint32*)&m_bufferData[offset+1];
+            m_remainingLength = *(uint32*)&m_bufferData[offset+5];
+            offset += 9;
+            m_isDropping = false;
+            m_taskSent = boost::posix_time::ptime();
+            boost::unordered_map<uint32, SentTask>::iterator it = m_tasks.find(m_taskID);
+            if (it != m_tasks.end())
+            {
+                m_taskSent = (*it).second.m_sent;
+                m_tasks.erase(it);
+                m_outstanding--;
+            }
+
+            if (_StartRelay(offset))
             {
-                task->SendResponse();
-                m_isReceiving = false;
+                return;
+            }
+
+            Task* task = TaskHolder::GetInstance().Find(m_taskID);
+            if (task)
+            {
+                boost::lock_guard<boost::mutex> lock(task->GetMutex(), boost::adopt_lock);
+                // The loser of a hedged task, its body is skipped.
+                m_isDropping = !task->PrepareResponse(m_remainingLength, isFailure);
+                if (!m_isDropping && task->IsResponseComplete())
+                {
+                    _RecordLatency(task);
+                    task->SendResponse();
+                }
             }
         }
         else
         {
-            m_isReceiving = false;
+            // We are not receiving nor creating a packet, probably something went wrong. Ignore it for now.
+            offset = m_bufferLength;
         }
     }
-    else if (m_bufferData[0] == TASK_MESSAGE_CREATION)
+
+    m_bufferLength -= offset;
+    memmove(m_bufferData, &m_bufferData[offset], m_bufferLength);
+    _Read(&Worker::_ReceiveData);
+}
+
+void Worker::_ForwardData (const char* data_, uint32 dataLength_)
+{
+    if (m_isDropping)
     {
-        m_taskID = *(uint32*)&m_bufferData[1];
-        Task* task = TaskHolder::GetInstance().Find(m_taskID);
-        uint32 dataLength = *(uint32*)&m_bufferData[5];
+        return;
+    }
 
-        if (task)
+    Task* task = TaskHolder::GetInstance().Find(m_taskID);
+    if (task)
+    {
+        boost::lock_guard<boost::mutex> lock(task->GetMutex(), boost::adopt_lock);
+        task->AppendData(data_, dataLength_);
+        Metrics::GetInstance().Increment(Metrics::Counter_RelayedBytes, dataLength_);
+        if (task->IsResponseComplete())
         {
-            task->PrepareResponse(dataLength);
-            task->AppendData(&m_bufferData[9], dataLength_-9);
-            
-            if (task->IsResponseComplete())
-            {
-                task->SendResponse();
-            }
-            else
-            {
-                m_isReceiving = true;
-            }
+            _RecordLatency(task);
+            task->SendResponse();
+        }
+    }
+}
+
+bool Worker::_StartRelay (size_t offset_)
+{
+#ifdef SPLICE_F_MOVE
+    // Only worth it when most of a large body is still in the socket.
+    size_t buffered = m_bufferLength-offset_;
+    if (!Config::GetInstance().IsSpliceRelay() || m_remainingLength < buffered+WORKER_RELAY_MIN_LENGTH)
+    {
+        return false;
+    }
+    if (m_relayPipe[0] < 0 && pipe2(m_relayPipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        m_relayPipe[0] = m_relayPipe[1] = -1;
+        return false;
+    }
+
+    Task* task = TaskHolder::GetInstance().Find(m_taskID);
+    if (!task)
+    {
+        return false;
+    }
+    std::string headers;
+    Connection* connection = NULL;
+    {
+        boost::lock_guard<boost::mutex> lock(task->GetMutex(), boost::adopt_lock);
+        connection = task->TakeRelay(m_remainingLength, headers);
+        if (connection)
+        {
+            _RecordLatency(task);
         }
     }
-    // We are not receiving nor creating a packet, probably something went wrong. Ignore it for now.
-    m_socket.async_read_some(boost::asio::buffer(m_bufferData, max_length), 
-        boost::bind(&Worker::_ReceiveData, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+    if (!connection)
+    {
+        return false;
+    }
+
+    // The part of the body already read goes out with the headers.
+    headers.append(&m_bufferData[offset_], buffered);
+    m_remainingLength -= buffered;
+    m_bufferLength = 0;
+    m_isRelaying = true;
+    boost::system::error_code error;
+    m_socket.non_blocking(true, error);
+    connection->RelayTask(m_taskID, this, headers, m_remainingLength);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Worker::_WaitRelay (Connection* connection_)
+{
+    m_pendingPosts--;
+    m_socket.async_read_some(boost::asio::null_buffers(),
+        m_strand.wrap(boost::bind(&Worker::_RelayReadable, this, connection_, boost::asio::placeholders::error)));
+}
+
+void Worker::_RelayReadable (Connection* connection_, const boost::system::error_code& error_)
+{
+    // The connection relays until it calls EndRelay(), it cannot be gone yet.
+    connection_->RelayReadable(error_);
+}
+
+void Worker::_EndRelay (uint32 unread_, bool pipeEmpty_, bool failed_)
+{
+    m_pendingPosts--;
+    m_isRelaying = false;
+    if (!pipeEmpty_)
+    {
+        _ClosePipe();
+    }
+    if (failed_)
+    {
+        _Close();
+        return;
+    }
+
+    // Whatever the connection did not take is read and dropped, the task is already completed.
+    m_remainingLength = unread_;
+    m_isDropping = (unread_ > 0);
+    _Read(&Worker::_ReceiveData);
+}
+
+void Worker::_ClosePipe ()
+{
+#ifdef SPLICE_F_MOVE
+    if (m_relayPipe[0] >= 0)
+    {
+        close(m_relayPipe[0]);
+        close(m_relayPipe[1]);
+        m_relayPipe[0] = m_relayPipe[1] = -1;
+    }
+#endif
 }
 
 void Worker::_HandleErrors (const boost::system::error_code& error_, size_t dataLength_)
 {
-    if (error_)
+    m_isWriting = false;
+    if (error_ || dataLength_ != m_writingLength)
+    {
+        _Close();
+        return;
+    }
+
+    m_writeQueue.erase(m_writeQueue.begin(), m_writeQueue.begin()+m_writingCount);
+    m_writingCount = 0;
+    if (m_isClosing)
+    {
+        _TryRelease();
+        return;
+    }
+    _Write();
+}
+
+void Worker::_Read (void (Worker::*handler_) (const boost::system::error_code&, size_t))
+{
+    if (m_isClosing)
+    {
+        _TryRelease();
+        return;
+    }
+
+    m_isReading = true;
+    m_socket.async_read_some(boost::asio::buffer(m_bufferData+m_bufferLength, max_length-m_bufferLength), 
+        m_strand.wrap(boost::bind(handler_, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void Worker::_Close ()
+{
+    if (!m_isClosing)
+    {
+        m_isClosing = true;
+        // Once out of the list nobody can post to this worker anymore.
+        if (m_isSubscribed)
+        {
+            Workers::GetInstance().UnsubscribeWorker(m_uid);
+        }
+        // The waiters of the tasks still owed get their answer from another worker instead of a 408.
+        for (boost::unordered_map<uint32, SentTask>::iterator it = m_tasks.begin(); it != m_tasks.end(); it++)
+        {
+            _Redispatch((*it).first, (*it).second.m_message);
+        }
+        m_tasks.clear();
+        if (m_isRelaying)
+        {
+            // The relaying connection still uses the descriptor, it sees the shutdown and gives it back.
+            boost::system::error_code error;
+            m_socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, error);
+        }
+        else
+        {
+            CloseConnection();
+        }
+    }
+    _TryRelease();
+}
+
+void Worker::_TryRelease ()
+{
+    if (m_isClosing && !m_isReading && !m_isWriting && !m_isRelaying && m_pendingPosts == 0)
     {
         delete this;
     }
-}
\ No newline at end of file
+}
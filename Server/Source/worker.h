@@ -1,8 +1,21 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include "workers.h"
+#include "metrics.h"
 #include <string>
+#include <deque>
+#include <vector>
+
+class Task;
+class Connection;
 
 class Worker
 {
@@ -12,25 +25,100 @@ public:
 
     boost::asio::ip::tcp::socket& GetSocket ();
     uint32 GetUniqueID ();
+    const std::string& GetAddress ();
+    // Can be called from any thread, the data is copied.
     void SendData (const char* data_, size_t dataLength_);
+    // SendData() for a task message, the worker owes an answer until the response header comes.
+    // The tasks it still owes when it closes are sent to the other workers.
+    void SendTask (const char* data_, size_t dataLength_);
     void CloseConnection ();
     void AcceptWorker ();
 
+    ///
+    /// Called by the connection a response was relayed to, the worker reads again.
+    /// @param[in] unread_ Body bytes left in the socket, skipped by the worker.
+    /// @param[in] pipeEmpty_ false if the relay pipe still holds data, it is replaced.
+    /// @param[in] failed_ The worker socket failed, the worker is closed.
+    ///
+    void EndRelay (uint32 unread_, bool pipeEmpty_, bool failed_);
+
+    // Waits on the strand for the socket to be readable, then calls Connection::RelayReadable().
+    void WaitRelay (Connection* connection_);
+
+    int GetRelayPipe (int end_) const;
+
+    // Time from sending the tasks to this worker to its answer.
+    const Histogram& GetLatency () const;
+
+    ///
+    /// Microseconds a new task would wait: the tasks not answered yet, plus the new one, times the
+    /// moving average of the latency. Read by the dispatching threads without any lock.
+    ///
+    uint64 GetExpectedWait () const;
+
 private:
+    void _SendData (boost::shared_ptr<std::string> data_);
+    void _SendTask (boost::shared_ptr<std::string> data_);
+    void _Redispatch (uint32 taskID_, const boost::shared_ptr<std::string>& message_);
+    void _PruneTasks ();
     void _CheckAccept (const boost::system::error_code& error_, size_t dataLength_);
     void _WaitConnection (const boost::system::error_code& error_, size_t dataLength_);
     void _ReceiveData (const boost::system::error_code& error_, size_t dataLength_);
+    void _ForwardData (const char* data_, uint32 dataLength_);
+    bool _StartRelay (size_t offset_);
+    void _WaitRelay (Connection* connection_);
+    void _RelayReadable (Connection* connection_, const boost::system::error_code& error_);
+    void _EndRelay (uint32 unread_, bool pipeEmpty_, bool failed_);
+    void _ClosePipe ();
+    void _Write ();
     void _HandleErrors (const boost::system::error_code& error_, size_t dataLength_);
+    void _Read (void (Worker::*handler_) (const boost::system::error_code&, size_t));
+    void _Close ();
+    void _TryRelease ();
+    void _RecordLatency (const Task* task_);
 
     enum { max_length = 65535 };
-    bool m_isReceiving;
+    bool m_isReading;
+    bool m_isClosing;
+    bool m_isSubscribed;
+    bool m_isWriting;
+    // A connection reads the socket, see Connection::RelayTask().
+    bool m_isRelaying;
+    int m_relayPipe[2];
+    uint32 m_writingCount;
+    size_t m_writingLength;
+    boost::atomic<int32> m_pendingPosts;
     uint32 m_taskID;
+    // Body bytes of m_taskID still to come, the next message starts after them.
+    uint32 m_remainingLength;
+    // The body of m_taskID is skipped, another worker answered the task.
+    bool m_isDropping;
+    // When m_taskID was sent to this worker, not_a_date_time if it was no longer tracked.
+    boost::posix_time::ptime m_taskSent;
     uint32 m_uid;
+    struct SentTask
+    {
+        boost::shared_ptr<std::string> m_message;
+        boost::posix_time::ptime m_sent;
+    };
+    // The tasks not answered yet by their id, only used on the strand.
+    boost::unordered_map<uint32, SentTask> m_tasks;
+    size_t m_pruneSize;
+    Histogram m_latency;
+    // Exponentially weighted, only written on the strand.
+    boost::atomic<uint32> m_latencyAverage;
+    boost::atomic<uint32> m_outstanding;
     std::string m_username;
     std::string m_password;
+    std::string m_address;
 
     boost::asio::ip::tcp::socket m_socket;
+    boost::asio::io_service::strand m_strand;
+    std::deque<boost::shared_ptr<std::string>> m_writeQueue;
+    std::vector<boost::asio::const_buffer> m_writeBuffers;
     char m_bufferData[max_length];
+    // Received bytes not handled yet, a message header cut by the read.
+    size_t m_bufferLength;
 
     static uint32 s_uidCounter;
-};
\ No newline at end of file
+};
@@ -2,9 +2,12 @@
 #include "worker.h"
 
 Workers::Workers ()
-    :m_lastWorker(0)
 {
     m_accountsList.push_back(std::pair<std::string, std::string>("ACCOUNT_NAME", "ACCOUNT_PASSWORD"));
+    for (uint32 i = 0; i < SERVER_MAX_SHARDS; i++)
+    {
+        m_shards[i].m_random = 0x9e3779b9*(i+1);
+    }
 }
 
 Workers::~Workers ()
@@ -17,57 +20,126 @@ Workers::~Workers ()
 
 void Workers::UnsubscribeWorker (uint32 uid_)
 {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
     for (std::vector<Worker*>::iterator it = m_workers.begin(); it != m_workers.end(); it++)
     {
         if (uid_ == (*it)->GetUniqueID())
         {
             m_workers.erase(it);
-            if (m_lastWorker == m_workers.size())
+            break;
+        }
+    }
+
+    for (uint32 i = 0; i < SERVER_MAX_SHARDS; i++)
+    {
+        ShardView& shard = m_shards[i];
+        boost::lock_guard<boost::mutex> shardLock(shard.m_mutex);
+        for (std::vector<Worker*>::iterator it = shard.m_workers.begin(); it != shard.m_workers.end(); it++)
+        {
+            if (uid_ == (*it)->GetUniqueID())
             {
-                m_lastWorker = 0;
+                shard.m_workers.erase(it);
+                break;
             }
-            return;
         }
     }
 }
 
 void Workers::SubscribeWorker (Worker* worker_)
 {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
     m_workers.push_back(worker_);
+
+    for (uint32 i = 0; i < SERVER_MAX_SHARDS; i++)
+    {
+        boost::lock_guard<boost::mutex> shardLock(m_shards[i].m_mutex);
+        m_shards[i].m_workers.push_back(worker_);
+    }
 }
 
-Worker* Workers::GetWorkerAtPosition (uint32 position_ )
+bool Workers::HasAvailableWorker (uint32 shard_)
 {
-    if (position_ < m_workers.size())
+    ShardView& shard = m_shards[shard_];
+    boost::lock_guard<boost::mutex> lock(shard.m_mutex);
+    return (shard.m_workers.size() != 0);
+}
+
+uint32 Workers::SendToAvailableWorker (uint32 shard_, const char* data_, size_t dataLength_, uint32 excludedUID_)
+{
+    ShardView& shard = m_shards[shard_];
+    boost::lock_guard<boost::mutex> lock(shard.m_mutex);
+    if (shard.m_workers.empty())
     {
-        return m_workers[position_];
+        return 0;
     }
 
-    return NULL;
+    Worker* worker = _PickWorker(shard, excludedUID_);
+    if (!worker)
+    {
+        return 0;
+    }
+    worker->SendTask(data_, dataLength_);
+    return worker->GetUniqueID();
 }
 
-bool Workers::HasAvailableWorker ()
+Worker* Workers::_PickWorker (ShardView& shard_, uint32 excludedUID_)
 {
-    return (m_workers.size() != 0);
+    // Power of two choices: of two workers drawn at random, the one a new task would wait the
+    // least for. A slow or stuck worker keeps its tasks outstanding and stops being picked.
+    size_t count = shard_.m_workers.size();
+    if (count == 1)
+    {
+        return (shard_.m_workers[0]->GetUniqueID() != excludedUID_) ? shard_.m_workers[0] : NULL;
+    }
+
+    uint32 draws[2];
+    for (uint32 i = 0; i < 2; i++)
+    {
+        shard_.m_random ^= shard_.m_random << 13;
+        shard_.m_random ^= shard_.m_random >> 17;
+        shard_.m_random ^= shard_.m_random << 5;
+        draws[i] = shard_.m_random;
+    }
+    size_t first = draws[0] % count;
+    size_t second = draws[1] % (count-1);
+    if (second >= first)
+    {
+        second++;
+    }
+
+    Worker* worker = shard_.m_workers[first];
+    Worker* other = shard_.m_workers[second];
+    if (worker->GetUniqueID() == excludedUID_)
+    {
+        return other;
+    }
+    if (other->GetUniqueID() == excludedUID_)
+    {
+        return worker;
+    }
+    return (other->GetExpectedWait() < worker->GetExpectedWait()) ? other : worker;
 }
 
-Worker* Workers::GetAvaiableWorker ()
+uint32 Workers::SendToWorkerAtPosition (uint32 position_, const char* data_, size_t dataLength_)
 {
-    if (++m_lastWorker == m_workers.size())
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    if (position_ < m_workers.size())
     {
-        m_lastWorker = 0;
+        m_workers[position_]->SendData(data_, dataLength_);
+        return m_workers[position_]->GetUniqueID();
     }
-    
-    return m_workers[m_lastWorker];
+
+    return 0;
 }
 
 std::string Workers::GetWorkersInformation ()
 {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
     std::string info("{\"code\":200,\"workers\":[");
     for (size_t i = 0; i < m_workers.size(); i++)
     {
         char infoStr[512];
-        sprintf(infoStr, "{\"uid\":%d, \"address\":\"%s\"}", i, m_workers[i]->GetSocket().remote_endpoint().address().to_string().c_str());
+        sprintf(infoStr, "{\"uid\":%d, \"address\":\"%s\"}", i, m_workers[i]->GetAddress().c_str());
         if (i != 0)
         {
             info.append(",");
@@ -78,8 +150,20 @@ std::string Workers::GetWorkersInformation ()
     return info;
 }
 
+void Workers::WriteLatency (std::string& out_, const char* name_)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        char labels[512];
+        sprintf(labels, "worker=\"%u\",address=\"%s\"", m_workers[i]->GetUniqueID(), m_workers[i]->GetAddress().c_str());
+        m_workers[i]->GetLatency().Write(out_, name_, labels);
+    }
+}
+
 std::pair<std::string, std::string> Workers::RequestCredentials ()
 {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
     std::list<std::pair<std::string, std::string>>::iterator it = m_accountsList.begin();
     std::pair<std::string, std::string> value = *it;
     m_accountsList.erase(it);
@@ -88,6 +172,7 @@ std::pair<std::string, std::string> Workers::RequestCredentials ()
 
 void Workers::ReleaseCredentials (std::string username_, std::string password_)
 {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
     m_accountsList.push_front(std::pair<std::string, std::string>(username_, password_));
 }
 
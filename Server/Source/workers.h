@@ -2,13 +2,19 @@
 #define _WORKERS_H_
 
 #include "types.h"
+#include "config.h"
 #include <string>
 #include <vector>
 #include <utility>
 #include <list>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 
 class Worker;
 
+// Safe to use from any thread. Workers are only reached while a list is locked, a worker
+// unsubscribes itself before going away.
+// Every I/O shard dispatches through its own copy of the list, so requests only take their shard lock.
 class Workers
 {
 public:
@@ -18,24 +24,51 @@ public:
 
     void UnsubscribeWorker (uint32 position_);
     void SubscribeWorker (Worker* worker_);
-    Worker* GetWorkerAtPosition (uint32 position_ );
 
-    bool HasAvailableWorker ();
+    bool HasAvailableWorker (uint32 shard_);
 
-    Worker* GetAvaiableWorker ();
+    ///
+    /// Sends a task to the worker of the shard expected to answer it first.
+    /// @param[in] excludedUID_ A worker not to pick, the one a hedged task went to first.
+    /// @return The unique id of the worker, or 0 if there is none.
+    ///
+    uint32 SendToAvailableWorker (uint32 shard_, const char* data_, size_t dataLength_, uint32 excludedUID_ = 0);
+
+    // Returns the unique id of the worker at position_, or 0 if there is no such worker.
+    uint32 SendToWorkerAtPosition (uint32 position_, const char* data_, size_t dataLength_);
 
     std::string GetWorkersInformation ();
 
+    // Appends the latency histogram of every worker, see Metrics.
+    void WriteLatency (std::string& out_, const char* name_);
+
     std::pair<std::string, std::string> RequestCredentials ();
     void ReleaseCredentials (std::string username_, std::string password_);
 
     static Workers& GetInstance();
 
 private:
-    
+
+    struct ShardView
+    {
+        ShardView ()
+         :m_random(0)
+        {};
+        boost::mutex m_mutex;
+        // xorshift state of the worker picks.
+        uint32 m_random;
+        std::vector<Worker*> m_workers;
+        // Keeps two shards off the same cache line.
+        char m_padding[64];
+    };
+
+    boost::mutex m_mutex;
     std::list<std::pair<std::string, std::string>> m_accountsList;
-    uint32 m_lastWorker;
     std::vector<Worker*> m_workers;
+    ShardView m_shards[SERVER_MAX_SHARDS];
+
+    // NULL if excludedUID_ is the only worker.
+    Worker* _PickWorker (ShardView& shard_, uint32 excludedUID_);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1 +1,48 @@
-port = 15000
\ No newline at end of file
+port = 15000
+
+-- Ports of the HTTP API and of the worker processes.
+api_port = 9876
+workers_port = 1331
+
+-- Threads running the I/O service, 0 uses one per hardware thread.
+io_threads = 1
+
+-- "pool" shares the threads between every connection, "shards" gives each thread its own
+-- connections, tasks and API listener (SO_REUSEPORT where available).
+io_mode = "pool"
+
+-- Completed worker responses kept in memory, 0 disables the cache.
+response_cache_entries = 16384
+-- Summoner names and icons kept one by one, so list requests only ask for the ids they miss.
+entity_cache_entries = 262144
+-- Milliseconds the short name and icon lookups wait for each other to be sent to a worker
+-- together, 0 sends each one right away.
+list_batch_window = 2
+
+-- Directory keeping the cached responses across restarts, "" keeps them in memory only.
+store_directory = ""
+-- Size in MB of each file of the store.
+store_segment_size = 64
+
+-- "copy" reads the worker responses before sending them, "splice" moves the large ones from the
+-- worker socket to the client socket inside the kernel (Linux only).
+relay_mode = "copy"
+
+-- Milliseconds a worker has to answer before the client gets 408 Request Timeout.
+task_timeout = 1500
+-- Timeouts of their own for some routes, by route pattern.
+route_timeouts = {
+    ["/player/{string}"] = 800,
+    ["/accountid/{number}/allPublicData"] = 4000,
+}
+-- "adaptive" sets the timeout of each route to the p99 latency of its last tasks times
+-- adaptive_timeout_factor, between adaptive_timeout_min and adaptive_timeout_max (ms). The
+-- timeouts above are used until a route has enough tasks.
+timeout_mode = "fixed"
+adaptive_timeout_factor = 4
+adaptive_timeout_min = 250
+adaptive_timeout_max = 10000
+
+-- Percent of extra worker tasks spent on hedged requests, 0 disables them: a task still
+-- unanswered after the p95 latency of its route is also sent to another worker.
+hedge_budget = 5
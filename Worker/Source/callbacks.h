@@ -20,13 +20,14 @@ extern boost::asio::ip::tcp::socket* g_socket;
 
 namespace REQUESTCALLBACK
 {
-    inline void CreateJsonData (std::string jsonData_, uint32 data_);
+    // A failed invoke is sent as 0x02, the server does not cache it.
+    inline void CreateJsonData (std::string jsonData_, uint32 data_, bool isFailure_);
 };
 
 inline void handle_write(const boost::system::error_code& error)
 {}
 
-void REQUESTCALLBACK::CreateJsonData (std::string jsonData_, uint32 taskID_)
+void REQUESTCALLBACK::CreateJsonData (std::string jsonData_, uint32 taskID_, bool isFailure_)
 {
     if (!g_socket)
     {
@@ -43,7 +44,7 @@ void REQUESTCALLBACK::CreateJsonData (std::string jsonData_, uint32 taskID_)
     std::string result = gzipedData.str();
     size_t left = result.length();
 
-    result[0] = 0x01;
+    result[0] = isFailure_ ? 0x02 : 0x01;
     *(uint*)&result[1] = *(uint*)&taskID_;
     *(uint*)&result[5] = left-9;
     const char* buffer = result.c_str();
@@ -1010,7 +1010,9 @@ void Client::_ParsePacket ()
             object << "{";
 
             object << "\"result\":";
-            AMF0::Decode(&realMessage, object, &message);
+            std::ostringstream result;
+            AMF0::Decode(&realMessage, result, &message);
+            object << result.str();
             
             object << ",\"code\":200";
 
@@ -1034,7 +1036,7 @@ void Client::_ParsePacket ()
                 ds::Map<int32, uint32>::Iterator it;
                 if (m_callback.Find(invokeID, &it))
                 {
-                    REQUESTCALLBACK::CreateJsonData (object.str(), it->value);
+                    REQUESTCALLBACK::CreateJsonData (object.str(), it->value, result.str() == "\"_error\"");
                     m_callback.RemoveAt(&it);
                 }
                 else if (m_testID == invokeID)